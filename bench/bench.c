@@ -0,0 +1,260 @@
+/* bench.c
+ *
+ * Benchmark harness for the tex binary. Generates synthetic corpora that
+ * stress one part of the parser each, runs the binary on every corpus and
+ * reports throughput and peak memory, one line per scenario:
+ *
+ *   bench/bench ./tex-bench [scenario ...]
+ *
+ * Corpora are generated the same way every time, in bench/corpus, so results
+ * can be compared between builds. Each scenario is run RUNS times and the
+ * fastest run is reported.
+ *
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RUNS 3
+#define CORPUS_DIR "bench/corpus"
+
+//Deterministic generator, so every build sees the same corpus
+static unsigned long seed;
+
+static unsigned rnd(unsigned n) {
+	seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+	return (seed >> 33) % n;
+}
+
+static const char *words[] = {
+	"the", "parser", "reads", "tokens", "from", "a", "stream", "of", "characters", "and",
+	"expands", "macros", "into", "their", "replacement", "text", "while", "keeping", "groups",
+	"balanced", "output", "is", "written", "in", "spans", "with", "glyphs", "mapped"
+};
+#define WORD_N (sizeof words / sizeof *words)
+
+static void prose(FILE *f, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		fputs(words[rnd(WORD_N)], f);
+		fputc(i % 12 == 11 ? '\n' : ' ', f);
+	}
+}
+
+static void gen_plain(FILE *f) {
+	for(int i = 0; i < 4000; i++) {
+		prose(f, 300);
+		fputs("\n\n", f);
+	}
+}
+
+static void gen_groups(FILE *f) {
+	for(int i = 0; i < 400; i++) {
+		for(int d = 0; d < 500; d++) fputs("{x", f);
+		for(int d = 0; d < 500; d++) fputs("y}", f);
+		fputc('\n', f);
+	}
+}
+
+static void gen_delimited(FILE *f) {
+	fputs("\\def\\arg#1\\stop{[#1]}\n", f);
+	for(int i = 0; i < 40; i++) {
+		fputs("\\arg ", f);
+		prose(f, 10000);
+		fputs("\\stop\n", f);
+	}
+}
+
+//Control sequence names are letters only, so numbers are spelled with a-j
+static void macro_name(FILE *f, unsigned n) {
+	fputs("\\m", f);
+	do fputc('a' + n % 10, f); while(n /= 10);
+}
+
+static void gen_defs(FILE *f) {
+	for(int i = 0; i < 20000; i++) {
+		fputs("\\def", f);
+		macro_name(f, i);
+		fprintf(f, "#1#2{%s #1 %s #2}\n", words[rnd(WORD_N)], words[rnd(WORD_N)]);
+	}
+	for(int i = 0; i < 20000; i++) {
+		macro_name(f, rnd(20000));
+		fputs("{a}{b}\n", f);
+	}
+}
+
+static void gen_recursive(FILE *f) {
+	//\walk calls itself for every item until it reaches \endwalk, which eats the last call
+	fputs("\\def\\walk#1{#1\\walk}\\def\\endwalk#1{}\n", f);
+	for(int i = 0; i < 20; i++) {
+		fputs("\\walk ", f);
+		for(int k = 0; k < 5000; k++)
+			fprintf(f, "{<%s>}", words[rnd(WORD_N)]);
+		fputs("\\endwalk\n", f);
+	}
+}
+
+static void gen_ligatures(FILE *f) {
+	static const char *lig[] = {"--", "---", "``", "''", "`", "'"};
+	for(int i = 0; i < 200000; i++) {
+		fputs(words[rnd(WORD_N)], f);
+		fputs(lig[rnd(6)], f);
+		fputc(i % 10 == 9 ? '\n' : ' ', f);
+	}
+}
+
+static void gen_write(FILE *f) {
+	fputs("\\openout1=write.out\n", f);
+	for(int i = 0; i < 50000; i++) {
+		fputs("\\write1{", f);
+		prose(f, 8);
+		fputs("}\n", f);
+	}
+}
+
+//Template style switches, most of the text is in branches that are not taken
+static void gen_conditionals(FILE *f) {
+	fputs("\\def\\html{}\n", f);
+	for(int i = 0; i < 2000; i++) {
+		fputs("\\ifdefined\\latex\n", f);
+		prose(f, 200);
+		fputs("\\ifdefined\\pdf \\pagebreak\\else\\newpage\\fi\n", f);
+		prose(f, 200);
+		fputs("\\else\\ifdefined\\html\n", f);
+		prose(f, 40);
+		fputs("\\else\n", f);
+		prose(f, 200);
+		fputs("\\fi\\fi\n", f);
+	}
+}
+
+struct scenario {
+	char *name;
+	void (*gen)(FILE *);
+};
+
+static struct scenario scenarios[] = {
+	{"plain", gen_plain},
+	{"groups", gen_groups},
+	{"delimited", gen_delimited},
+	{"defs", gen_defs},
+	{"recursive", gen_recursive},
+	{"ligatures", gen_ligatures},
+	{"write", gen_write},
+	{"conditionals", gen_conditionals},
+};
+#define SCENARIO_N (sizeof scenarios / sizeof *scenarios)
+
+static void die(char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "bench: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	exit(1);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//Run tex on the corpus, returns the wall time and fills in the peak RSS and tokens read
+static double run(char *tex, char *corpus, long *rss, unsigned long long *tokens) {
+	char stats[] = CORPUS_DIR "/stats.XXXXXX";
+	int fd = mkstemp(stats);
+	if(fd < 0) die("could not create %s", stats);
+
+	fflush(stdout);
+	double start = now();
+	pid_t pid = fork();
+	if(pid < 0) die("could not fork");
+	if(pid == 0) {
+		if(!freopen("/dev/null", "w", stdout)) _exit(127);
+		dup2(fd, 2);
+		if(chdir(CORPUS_DIR) < 0) _exit(127);
+		execl(tex, tex, "--stats", corpus, (char *)NULL);
+		_exit(127);
+	}
+
+	int status;
+	struct rusage ru;
+	if(wait4(pid, &status, 0, &ru) < 0) die("wait failed");
+	double t = now() - start;
+
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		die("%s failed on %s, see %s", tex, corpus, stats);
+
+	*rss = ru.ru_maxrss;
+
+	FILE *f = fdopen(fd, "r");
+	rewind(f);
+	char line[256];
+	*tokens = 0;
+	while(fgets(line, sizeof line, f))
+		sscanf(line, "read: %*u characters, %llu tokens", tokens);
+	fclose(f);
+	unlink(stats);
+
+	return t;
+}
+
+int main(int argc, char *argv[]) {
+	if(argc < 2) die("usage: bench <tex binary> [scenario ...]");
+
+	//The binary is run from the corpus directory
+	char tex[4096];
+	if(!realpath(argv[1], tex)) die("could not find %s", argv[1]);
+
+	if(mkdir(CORPUS_DIR, 0777) < 0 && errno != EEXIST)
+		die("could not create %s", CORPUS_DIR);
+
+	printf("%-12s %10s %10s %10s %12s\n", "scenario", "size KB", "MB/s", "Mtok/s", "peak RSS KB");
+
+	for(size_t i = 0; i < SCENARIO_N; i++) {
+		struct scenario *s = &scenarios[i];
+
+		if(argc > 2) {
+			int k = 2;
+			while(k < argc && strcmp(argv[k], s->name) != 0) k++;
+			if(k == argc) continue;
+		}
+
+		char name[256], path[512];
+		snprintf(name, sizeof name, "%s.tex", s->name);
+		snprintf(path, sizeof path, CORPUS_DIR "/%s", name);
+
+		FILE *f = fopen(path, "w");
+		if(!f) die("could not write %s", path);
+		seed = i + 1;
+		s->gen(f);
+		long size = ftell(f);
+		fclose(f);
+
+		double best = 0;
+		long rss = 0;
+		unsigned long long tokens = 0;
+		for(int r = 0; r < RUNS; r++) {
+			long run_rss;
+			double t = run(tex, name, &run_rss, &tokens);
+			if(r == 0 || t < best) best = t;
+			if(run_rss > rss) rss = run_rss;
+		}
+
+		printf("%-12s %10ld %10.1f %10.2f %12ld\n", s->name, size / 1024,
+			size / best / 1e6, tokens / best / 1e6, rss);
+		fflush(stdout);
+	}
+
+	return 0;
+}
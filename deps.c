@@ -0,0 +1,246 @@
+/* deps.c
+ *
+ * Dependency database for incremental builds. For every output it keeps the
+ * files the document read and wrote last time it was rendered, each with a
+ * hash of its contents. An output is up to date while it is made from the
+ * same input and all of those files still hash the same.
+ *
+ * The database is a text file of records, one per output:
+ *
+ *   doc <output>
+ *   src <input>
+ *   fmt <format>		(if rendered with a format)
+ *   in <hash> <file>
+ *   out <hash> <file>
+ *
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tex.h"
+
+//Hash the contents of a file with 64 bit FNV-1a, returns FALSE if it cannot be read
+int tex_hash_file(char *name, uint64_t *hash) {
+	int fd = open(name, O_RDONLY);
+	if(fd < 0) return FALSE;
+
+	struct stat st;
+	if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return FALSE;
+	}
+
+	uint64_t h = 14695981039346656037ULL;
+	if(st.st_size > 0) {
+		unsigned char *d = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(d == MAP_FAILED) {
+			close(fd);
+			return FALSE;
+		}
+
+		for(off_t i = 0; i < st.st_size; i++) {
+			h ^= d[i];
+			h *= 1099511628211ULL;
+		}
+		munmap(d, st.st_size);
+	}
+
+	close(fd);
+	*hash = h;
+	return TRUE;
+}
+
+static void tex_depdb_doc_free(struct tex_depdb_doc *doc) {
+	free(doc->out);
+	free(doc->in);
+	free(doc->format);
+	for(size_t i = 0; i < doc->file_n; i++)
+		free(doc->file[i].name);
+	free(doc->file);
+	*doc = (struct tex_depdb_doc){0};
+}
+
+void tex_depdb_free(struct tex_depdb *db) {
+	for(size_t i = 0; i < db->doc_n; i++)
+		tex_depdb_doc_free(&db->doc[i]);
+	free(db->doc);
+	*db = (struct tex_depdb){0};
+}
+
+static int tex_depdb_doc_add(struct tex_depdb_doc *doc, char *name, int output, uint64_t hash) {
+	struct tex_depdb_file *file = realloc(doc->file, (doc->file_n + 1) * sizeof *file);
+	if(!file) return FALSE;
+	doc->file = file;
+
+	name = strdup(name);
+	if(!name) return FALSE;
+	doc->file[doc->file_n++] = (struct tex_depdb_file){name, output, hash};
+	return TRUE;
+}
+
+//Returns the record for output, or NULL if there is none
+struct tex_depdb_doc *tex_depdb_find(struct tex_depdb *db, char *out) {
+	for(size_t i = 0; i < db->doc_n; i++)
+		if(strcmp(db->doc[i].out, out) == 0)
+			return &db->doc[i];
+	return NULL;
+}
+
+//Replace the record for doc->out with doc, the database owns doc afterwards
+int tex_depdb_set(struct tex_depdb *db, struct tex_depdb_doc doc) {
+	struct tex_depdb_doc *old = tex_depdb_find(db, doc.out);
+	if(old) {
+		tex_depdb_doc_free(old);
+		*old = doc;
+		return TRUE;
+	}
+
+	struct tex_depdb_doc *d = realloc(db->doc, (db->doc_n + 1) * sizeof *d);
+	if(!d) {
+		tex_depdb_doc_free(&doc);
+		return FALSE;
+	}
+	db->doc = d;
+	db->doc[db->doc_n++] = doc;
+	return TRUE;
+}
+
+//Forget the record for out, so it is rendered next time
+void tex_depdb_remove(struct tex_depdb *db, char *out) {
+	struct tex_depdb_doc *doc = tex_depdb_find(db, out);
+	if(!doc) return;
+
+	tex_depdb_doc_free(doc);
+	*doc = db->doc[--db->doc_n];
+}
+
+//Make a record for out rendered from in with format (or NULL) and the files the
+//document used, hashing them as they are now. Returns FALSE if any of them cannot be read
+int tex_depdb_record(struct tex_depdb_doc *doc, char *in, char *out, char *format, struct tex_dep *dep, size_t dep_n) {
+	*doc = (struct tex_depdb_doc){strdup(out), strdup(in), format ? strdup(format) : NULL};
+	if(!doc->out || !doc->in || (format && !doc->format)) {
+		tex_depdb_doc_free(doc);
+		return FALSE;
+	}
+
+	for(size_t i = 0; i < dep_n; i++) {
+		uint64_t hash;
+		if(!tex_hash_file(dep[i].name, &hash) || !tex_depdb_doc_add(doc, dep[i].name, dep[i].output, hash)) {
+			tex_depdb_doc_free(doc);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+//Returns TRUE if the record is for the same input and format and every file in it
+//still has the same contents. Records without an input are never up to date
+int tex_depdb_fresh(struct tex_depdb_doc *doc, char *in, char *format) {
+	if(!doc->in || strcmp(doc->in, in) != 0)
+		return FALSE;
+	if(!doc->format != !format || (format && strcmp(doc->format, format) != 0))
+		return FALSE;
+
+	for(size_t i = 0; i < doc->file_n; i++) {
+		uint64_t hash;
+		if(!tex_hash_file(doc->file[i].name, &hash) || hash != doc->file[i].hash)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+//Read a database, a missing file is an empty database. Returns FALSE if the file is damaged
+int tex_depdb_load(struct tex_depdb *db, char *filename) {
+	*db = (struct tex_depdb){0};
+
+	FILE *f = fopen(filename, "r");
+	if(!f) return TRUE;
+
+	char *line = NULL;
+	size_t line_cap = 0;
+	int ok = TRUE;
+	struct tex_depdb_doc doc = {0};
+
+	while(ok && getline(&line, &line_cap, f) >= 0) {
+		line[strcspn(line, "\n")] = 0;
+
+		if(strncmp(line, "doc ", 4) == 0) {
+			if(doc.out) ok = tex_depdb_set(db, doc);
+			doc = (struct tex_depdb_doc){strdup(line + 4)};
+			ok = ok && doc.out;
+			continue;
+		}
+
+		if(strncmp(line, "src ", 4) == 0) {
+			ok = doc.out && !doc.in && (doc.in = strdup(line + 4));
+			continue;
+		}
+
+		if(strncmp(line, "fmt ", 4) == 0) {
+			ok = doc.out && !doc.format && (doc.format = strdup(line + 4));
+			continue;
+		}
+
+		int output = strncmp(line, "out ", 4) == 0;
+		if(!doc.out || (!output && strncmp(line, "in ", 3) != 0)) {
+			ok = FALSE;
+			break;
+		}
+
+		char *end, *s = line + (output ? 4 : 3);
+		uint64_t hash = strtoull(s, &end, 16);
+		ok = end != s && *end == ' ' && tex_depdb_doc_add(&doc, end + 1, output, hash);
+	}
+
+	if(ok && doc.out)
+		ok = tex_depdb_set(db, doc);
+	else
+		tex_depdb_doc_free(&doc);
+
+	free(line);
+	fclose(f);
+	return ok;
+}
+
+//Write a database, replacing the old file only once the new one is complete
+int tex_depdb_save(struct tex_depdb *db, char *filename) {
+	size_t n = strlen(filename);
+	char *tmp = malloc(n + 5);
+	if(!tmp) return FALSE;
+	memcpy(tmp, filename, n);
+	memcpy(tmp + n, ".tmp", 5);
+
+	FILE *f = fopen(tmp, "w");
+	if(!f) {
+		free(tmp);
+		return FALSE;
+	}
+
+	for(size_t i = 0; i < db->doc_n; i++) {
+		struct tex_depdb_doc *doc = &db->doc[i];
+		fprintf(f, "doc %s\n", doc->out);
+		if(doc->in)
+			fprintf(f, "src %s\n", doc->in);
+		if(doc->format)
+			fprintf(f, "fmt %s\n", doc->format);
+		for(size_t j = 0; j < doc->file_n; j++)
+			fprintf(f, "%s %016llx %s\n", doc->file[j].output ? "out" : "in",
+				(unsigned long long)doc->file[j].hash, doc->file[j].name);
+	}
+
+	int ok = !ferror(f);
+	ok = fclose(f) == 0 && ok;
+	ok = ok && rename(tmp, filename) == 0;
+	if(!ok) unlink(tmp);
+
+	free(tmp);
+	return ok;
+}
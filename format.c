@@ -0,0 +1,358 @@
+/* format.c
+ *
+ * Format files hold the state of a parser after a preamble has been read:
+ * global definitions, category codes and the glyph map. Loading one replaces
+ * reading the preamble again.
+ *
+ * The file is a header followed by arrays addressed by offset. Compiled macro
+ * bodies are used straight from the mapped file, so processes loading the same
+ * format share those pages. Symbol ids are stored as they are, a format can
+ * only be loaded by a program that registers the same handlers in the same
+ * order as the one that dumped it.
+ *
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tex.h"
+
+#define TEX_FORMAT_MAGIC "TEXFMT03"
+
+struct tex_format_str {
+	uint64_t off, len;	//Characters, followed by a 0
+};
+
+struct tex_format_val {
+	uint32_t sym;
+	uint32_t handler;	//Name the C handler was registered under, 0 for macros defined in TeX
+	int32_t param_n;
+	uint32_t macro;		//Value has a compiled body, which may be empty
+	uint64_t arglist, arglist_n;	//tex_packed
+	uint64_t op, op_n;		//struct tex_macro_op
+	uint64_t tok, tok_n;		//tex_packed
+};
+
+//Category codes of a page of code points above ASCII
+struct tex_format_cat_page {
+	uint64_t page;
+	char cat[TEX_CAT_PAGE_SIZE];
+};
+
+struct tex_format_header {
+	char magic[8];
+	uint32_t token_size;	//Layout checks, a format belongs to one build
+	uint32_t op_size;
+	uint64_t size;
+	uint64_t sym, sym_n;	//struct tex_format_str for symbol ids 1 to sym_n
+	uint64_t map, map_n;	//Pairs of struct tex_format_str, input and output
+	uint64_t val, val_n;	//struct tex_format_val
+	uint64_t cat_page, cat_page_n;	//struct tex_format_cat_page
+	char cat[128];
+};
+
+//Output buffer for a format being written
+struct tex_format_buf {
+	char *d;
+	size_t n, cap;
+};
+
+//Append n bytes aligned to 8, returns their offset
+static uint64_t tex_format_put(struct tex_parser *p, struct tex_format_buf *b, const void *d, size_t n) {
+	size_t off = (b->n + 7) & ~(size_t)7;
+
+	if(off + n > b->cap) {
+		size_t cap = b->cap ? b->cap : 4096;
+		while(off + n > cap)
+			cap *= 2;
+		char *nd = realloc(b->d, cap);
+		if(!nd) p->error(p, "Could not allocate memory");
+		b->d = nd;
+		b->cap = cap;
+	}
+
+	memset(b->d + b->n, 0, off - b->n);
+	if(n) memcpy(b->d + off, d, n);
+	b->n = off + n;
+	return off;
+}
+
+static struct tex_format_str tex_format_put_str(struct tex_parser *p, struct tex_format_buf *b, const char *s, size_t n) {
+	char *z = malloc(n + 1);
+	if(!z) p->error(p, "Could not allocate memory");
+	memcpy(z, s, n);
+	z[n] = 0;
+
+	struct tex_format_str ret = {tex_format_put(p, b, z, n + 1), n};
+	free(z);
+	return ret;
+}
+
+//Write every mapping below node, path holds the input leading to it
+static void tex_format_put_map(struct tex_parser *p, struct tex_format_buf *b, struct tex_format_buf *pairs,
+		unsigned node, char *path, size_t depth) {
+	struct tex_map_node *n = &p->map.node[node];
+
+	if(n->out) {
+		struct tex_format_str s[2] = {
+			tex_format_put_str(p, b, path, depth),
+			tex_format_put_str(p, b, n->out, strlen(n->out))
+		};
+		tex_format_put(p, pairs, s, sizeof s);
+	}
+
+	if(depth == CS_MAX)
+		p->error(p, "Glyph mapping is too long to dump");
+
+	if(node == 0) {
+		for(int c = 0; c < 256; c++) {
+			if(!p->map.root[c]) continue;
+			path[depth] = c;
+			tex_format_put_map(p, b, pairs, p->map.root[c], path, depth + 1);
+		}
+		return;
+	}
+
+	for(size_t i = 0; i < n->edge_n; i++) {
+		path[depth] = n->edge[i].c;
+		tex_format_put_map(p, b, pairs, n->edge[i].node, path, depth + 1);
+	}
+}
+
+static unsigned tex_format_handler_name(struct tex_parser *p, struct tex_val *v) {
+	if(v->handler == tex_handle_macro_general)
+		return 0;
+
+	for(size_t i = 0; i < p->handler_n; i++)
+		if(p->handler[i].fn == v->handler)
+			return p->handler[i].sym;
+
+	p->error(p, "Cannot dump \\%s, its handler was not registered", tex_symbol_name(p, v->cs.sym));
+	return 0;
+}
+
+//Write the global state of the parser to filename
+void tex_format_dump(struct tex_parser *p, char *filename) {
+	assert(p);
+
+	if(p->level > 0)
+		p->error(p, "Cannot dump a format inside a group");
+
+	struct tex_format_buf b = {0}, pairs = {0}, vals = {0};
+	struct tex_format_header h = {TEX_FORMAT_MAGIC, sizeof(tex_packed), sizeof(struct tex_macro_op)};
+	tex_format_put(p, &b, &h, sizeof h);
+
+	memcpy(h.cat, p->cat, sizeof h.cat);
+
+	//Category codes above ASCII, pages that are all TEX_OTHER are left out
+	struct tex_format_buf pages = {0};
+	for(size_t i = 0; p->cat_page && i < TEX_CAT_PAGE_N; i++) {
+		if(!p->cat_page[i]) continue;
+
+		struct tex_format_cat_page page = {i};
+		memcpy(page.cat, p->cat_page[i]->cat, sizeof page.cat);
+		tex_format_put(p, &pages, &page, sizeof page);
+		h.cat_page_n++;
+	}
+	h.cat_page = tex_format_put(p, &b, pages.d, pages.n);
+	free(pages.d);
+
+	//Symbol names
+	struct tex_format_str *sym = malloc(p->symtab.n * sizeof *sym);
+	if(!sym) p->error(p, "Could not allocate memory");
+	for(unsigned id = 1; id < p->symtab.n; id++)
+		sym[id] = tex_format_put_str(p, &b, p->symtab.sym[id].name, p->symtab.sym[id].len);
+	h.sym_n = p->symtab.n - 1;
+	h.sym = tex_format_put(p, &b, sym + 1, h.sym_n * sizeof *sym);
+	free(sym);
+
+	//Glyph map
+	char path[CS_MAX];
+	tex_format_put_map(p, &b, &pairs, 0, path, 0);
+	h.map_n = pairs.n / (2 * sizeof(struct tex_format_str));
+	h.map = tex_format_put(p, &b, pairs.d, pairs.n);
+
+	//Definitions, with the token arrays they use
+	for(unsigned id = 1; id < p->symtab.n; id++) {
+		struct tex_val *v = p->symtab.sym[id].val;
+		if(!v) continue;
+
+		struct tex_format_val fv = {id, tex_format_handler_name(p, v)};
+
+		struct tex_macro *m = v->macro;
+		if(m) {
+			fv.macro = TRUE;
+			fv.param_n = m->param_n;
+			fv.op_n = m->op_n;
+			fv.op = tex_format_put(p, &b, m->op, m->op_n * sizeof *m->op);
+
+			fv.tok_n = m->tok_n;
+			fv.tok = tex_format_put(p, &b, m->tok, m->tok_n * sizeof *m->tok);
+			fv.arglist_n = m->arg_n;
+			fv.arglist = tex_format_put(p, &b, m->arg, m->arg_n * sizeof *m->arg);
+		}
+
+		tex_format_put(p, &vals, &fv, sizeof fv);
+		h.val_n++;
+	}
+	h.val = tex_format_put(p, &b, vals.d, vals.n);
+
+	h.size = b.n;
+	memcpy(b.d, &h, sizeof h);
+
+	FILE *f = fopen(filename, "wb");
+	if(!f || fwrite(b.d, 1, b.n, f) != b.n || fclose(f) != 0)
+		p->error(p, "Could not write format file %s", filename);
+
+	free(b.d);
+	free(pairs.d);
+	free(vals.d);
+}
+
+//Returns n objects of size at off in the loaded format, checking they are in the file
+static void *tex_format_at(struct tex_parser *p, uint64_t off, uint64_t n, size_t size) {
+	if(off % 8 || off > p->format_n || (size && n > (p->format_n - off) / size))
+		p->error(p, "Format file is damaged");
+	return (char *)p->format + off;
+}
+
+static char *tex_format_str_at(struct tex_parser *p, struct tex_format_str s) {
+	char *str = tex_format_at(p, s.off, s.len + 1, 1);
+	if(str[s.len] != 0)
+		p->error(p, "Format file is damaged");
+	return str;
+}
+
+static void tex_format_check_tokens(struct tex_parser *p, tex_packed *tok, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		struct tex_token t = tex_token_unpack(tok[i]);
+		if(t.cat >= TEX_CAT_NUM || (t.cat == TEX_ESC ? t.sym == 0 || t.sym >= p->symtab.n : t.c > TEX_RAW_BYTE + 255))
+			p->error(p, "Format file is damaged");
+	}
+}
+
+//Load a format written by tex_format_dump(), its definitions replace any existing ones.
+//The handlers the format refers to must be registered first
+void tex_format_load(struct tex_parser *p, char *filename) {
+	assert(p);
+
+	if(p->format)
+		p->error(p, "A format file is already loaded");
+	if(p->level > 0)
+		p->error(p, "Cannot load a format inside a group");
+
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0) p->error(p, "Could not open format file %s", filename);
+
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct tex_format_header))
+		p->error(p, "%s is not a format file", filename);
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		p->error(p, "Could not map format file %s", filename);
+
+	p->format = map;
+	p->format_n = st.st_size;
+
+	struct tex_format_header *h = map;
+	if(memcmp(h->magic, TEX_FORMAT_MAGIC, sizeof h->magic) != 0 || h->size != p->format_n)
+		p->error(p, "%s is not a format file", filename);
+	if(h->token_size != sizeof(tex_packed) || h->op_size != sizeof(struct tex_macro_op))
+		p->error(p, "Format file %s was written by a different build", filename);
+
+	//Symbols must keep their ids, so tokens can be used as they are
+	struct tex_format_str *sym = tex_format_at(p, h->sym, h->sym_n, sizeof *sym);
+	for(unsigned id = 1; id <= h->sym_n; id++) {
+		struct tex_format_str s = sym[id-1];
+		char *name = tex_format_str_at(p, s);
+
+		if(id < p->symtab.n) {
+			if(p->symtab.sym[id].len != s.len || memcmp(p->symtab.sym[id].name, name, s.len) != 0)
+				p->error(p, "Format file %s was written by a different program", filename);
+		} else if(tex_symbol_n(p, name, s.len) != id)
+			p->error(p, "Format file %s is damaged", filename);
+	}
+
+	memcpy(p->cat, h->cat, sizeof p->cat);
+	p->scan.dirty = TRUE;
+
+	tex_cat_pages_free(p);
+	struct tex_format_cat_page *page = tex_format_at(p, h->cat_page, h->cat_page_n, sizeof *page);
+	for(size_t i = 0; i < h->cat_page_n; i++) {
+		if(page[i].page >= TEX_CAT_PAGE_N)
+			p->error(p, "Format file %s is damaged", filename);
+
+		//The first page also covers ASCII, which is in the header
+		for(uint32_t c = 0; c < TEX_CAT_PAGE_SIZE; c++) {
+			if(page[i].cat[c] < 0 || page[i].cat[c] >= TEX_CAT_NUM)
+				p->error(p, "Format file %s is damaged", filename);
+			uint32_t cp = (uint32_t)page[i].page << TEX_CAT_PAGE_BITS | c;
+			if(cp >= 128)
+				tex_catcode_store(p, cp, page[i].cat[c]);
+		}
+	}
+
+	struct tex_format_str *pair = tex_format_at(p, h->map, h->map_n, 2 * sizeof *pair);
+	for(size_t i = 0; i < h->map_n; i++) {
+		char *in = tex_format_str_at(p, pair[2*i]);
+		char *out = tex_format_str_at(p, pair[2*i+1]);
+		if(*in) tex_map_add(p, in, out);
+	}
+
+	struct tex_format_val *fv = tex_format_at(p, h->val, h->val_n, sizeof *fv);
+	for(size_t i = 0; i < h->val_n; i++) {
+		if(fv[i].sym == 0 || fv[i].sym >= p->symtab.n || fv[i].param_n < 0 || fv[i].param_n > 9)
+			p->error(p, "Format file %s is damaged", filename);
+
+		struct tex_val v = {TEX_MACRO, (struct tex_token){TEX_ESC, .sym=fv[i].sym}, .handler=tex_handle_macro_general};
+
+		if(fv[i].handler) {
+			size_t j = 0;
+			while(j < p->handler_n && p->handler[j].sym != fv[i].handler)
+				j++;
+			if(j == p->handler_n || fv[i].handler >= p->symtab.n)
+				p->error(p, "Format file %s uses an unknown handler", filename);
+			v.handler = p->handler[j].fn;
+			v.conditional = p->handler[j].conditional;
+		}
+
+		if(fv[i].macro) {
+			struct tex_macro_op *op = tex_format_at(p, fv[i].op, fv[i].op_n, sizeof *op);
+			tex_packed *tok = tex_format_at(p, fv[i].tok, fv[i].tok_n, sizeof *tok);
+			tex_packed *arg = tex_format_at(p, fv[i].arglist, fv[i].arglist_n, sizeof *arg);
+			tex_format_check_tokens(p, tok, fv[i].tok_n);
+			tex_format_check_tokens(p, arg, fv[i].arglist_n);
+
+			for(size_t j = 0; j < fv[i].op_n; j++) {
+				if(op[j].type == TEX_OP_PARAM ? op[j].n < 1 || op[j].n > (size_t)fv[i].param_n
+						: op[j].i > fv[i].tok_n || op[j].n > fv[i].tok_n - op[j].i)
+					p->error(p, "Format file %s is damaged", filename);
+			}
+
+			int param_n = 0;
+			for(size_t j = 0; j < fv[i].arglist_n; j++)
+				if(tex_packed_cat(arg[j]) == TEX_PARAMETER) param_n++;
+			if(param_n != fv[i].param_n)
+				p->error(p, "Format file %s is damaged", filename);
+
+			//The body and parameter text stay in the mapped file, only the header and
+			//delimiter table are allocated
+			struct tex_macro *m = malloc(sizeof *m + fv[i].arglist_n * sizeof *m->fail);
+			if(!m) p->error(p, "Could not allocate memory");
+			*m = (struct tex_macro){1, fv[i].param_n, op, fv[i].op_n, tok, fv[i].tok_n, arg, fv[i].arglist_n, (size_t *)(m+1)};
+			tex_macro_delimiters(m);
+			v.macro = m;
+		} else if(fv[i].arglist_n)
+			p->error(p, "Format file %s is damaged", filename);
+
+		tex_val_set_global(p, v);
+	}
+}
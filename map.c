@@ -0,0 +1,137 @@
+/* map.c
+ *
+ * Glyph map, replacing input character sequences such as "---" with output
+ * strings. The sequences are stored in a trie, so finding the longest match
+ * at a position takes one step per character of lookahead, however many
+ * sequences are defined.
+ *
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tex.h"
+
+void tex_map_init(struct tex_parser *p) {
+	struct tex_map *map = &p->map;
+	memset(map, 0, sizeof *map);
+
+	map->node = malloc(sizeof *map->node);
+	if(!map->node) p->error(p, "Could not allocate memory");
+	map->node[0] = (struct tex_map_node){0};
+	map->node_n = map->node_cap = 1;
+}
+
+void tex_map_free(struct tex_parser *p) {
+	struct tex_map *map = &p->map;
+
+	for(size_t i = 0; i < map->node_n; i++) {
+		free(map->node[i].out);
+		free(map->node[i].edge);
+	}
+	free(map->node);
+
+	memset(map, 0, sizeof *map);
+}
+
+//Copy the glyph map of another parser
+void tex_map_copy(struct tex_parser *p, struct tex_parser *from) {
+	struct tex_map *map = &p->map, *src = &from->map;
+
+	memcpy(map->root, src->root, sizeof map->root);
+	map->node = malloc(src->node_cap * sizeof *map->node);
+	if(!map->node) p->error(p, "Could not allocate memory");
+	map->node_cap = src->node_cap;
+
+	//Nodes are counted as they are copied, so a failed copy can be freed
+	for(size_t i = 0; i < src->node_n; i++) {
+		struct tex_map_node *n = &map->node[i], *s = &src->node[i];
+		*n = (struct tex_map_node){NULL, NULL, s->edge_n};
+		map->node_n = i + 1;
+
+		if(s->out) {
+			n->out = strdup(s->out);
+			if(!n->out) p->error(p, "Could not allocate memory");
+		}
+
+		if(s->edge_n) {
+			n->edge = malloc(s->edge_n * sizeof *n->edge);
+			if(!n->edge) p->error(p, "Could not allocate memory");
+			memcpy(n->edge, s->edge, s->edge_n * sizeof *n->edge);
+		}
+	}
+}
+
+//Returns the child of node reached by c, or 0 if there is none
+unsigned tex_map_next(struct tex_map *map, unsigned node, unsigned char c) {
+	if(node == 0) return map->root[c];
+
+	struct tex_map_node *n = &map->node[node];
+	size_t lo = 0, hi = n->edge_n;
+	while(lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if(n->edge[mid].c < c) lo = mid + 1;
+		else hi = mid;
+	}
+
+	if(lo < n->edge_n && n->edge[lo].c == c)
+		return n->edge[lo].node;
+	return 0;
+}
+
+static unsigned tex_map_child(struct tex_parser *p, unsigned node, unsigned char c) {
+	struct tex_map *map = &p->map;
+
+	unsigned child = tex_map_next(map, node, c);
+	if(child) return child;
+
+	if(map->node_n == map->node_cap) {
+		size_t cap = 2 * map->node_cap;
+		struct tex_map_node *n = realloc(map->node, cap * sizeof *n);
+		if(!n) p->error(p, "Could not allocate memory");
+		map->node = n;
+		map->node_cap = cap;
+	}
+
+	child = map->node_n++;
+	map->node[child] = (struct tex_map_node){0};
+
+	if(node == 0) {
+		map->root[c] = child;
+		return child;
+	}
+
+	//Insert the edge keeping edges sorted
+	struct tex_map_node *n = &map->node[node];
+	struct tex_map_edge *edge = realloc(n->edge, (n->edge_n + 1) * sizeof *edge);
+	if(!edge) p->error(p, "Could not allocate memory");
+	n->edge = edge;
+
+	size_t i = n->edge_n;
+	while(i > 0 && edge[i-1].c > c) {
+		edge[i] = edge[i-1];
+		i--;
+	}
+	edge[i] = (struct tex_map_edge){c, child};
+	n->edge_n++;
+
+	return child;
+}
+
+//Map the input sequence in to out, replacing any previous mapping of in
+void tex_map_add(struct tex_parser *p, char *in, char *out) {
+	assert(in && *in && out);
+
+	unsigned node = 0;
+	for(; *in; in++)
+		node = tex_map_child(p, node, *in);
+
+	char *s = strdup(out);
+	if(!s) p->error(p, "Could not allocate memory");
+
+	free(p->map.node[node].out);
+	p->map.node[node].out = s;
+
+	p->scan.dirty = TRUE;
+}
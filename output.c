@@ -0,0 +1,265 @@
+/* output.c
+ *
+ * Output streams opened by \openout. \write appends text to a chunk of its
+ * stream, and full chunks are handed to a writer thread of the parser, so
+ * expansion does not wait for the file system. Closing a stream waits until
+ * its chunks have been written and reports any write that failed, so does
+ * the next \write to a stream once the writer has seen an error.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tex.h"
+
+//Write a chunk to its file, returns an errno value if that failed or 0
+static int tex_out_chunk_write(struct tex_out_chunk *c) {
+	if(fwrite(c->d, 1, c->n, c->out->file) == c->n)
+		return 0;
+	return errno ? errno : EIO;
+}
+
+static void *tex_writer_main(void *arg) {
+	struct tex_writer *w = arg;
+
+	pthread_mutex_lock(&w->lock);
+	for(;;) {
+		while(!w->head && !w->stop)
+			pthread_cond_wait(&w->work, &w->lock);
+		if(!w->head) break;
+
+		struct tex_out_chunk *c = w->head;
+		w->head = c->next;
+		if(!w->head) w->tail = NULL;
+		pthread_mutex_unlock(&w->lock);
+
+		int error = tex_out_chunk_write(c);
+
+		pthread_mutex_lock(&w->lock);
+		if(error && !c->out->error)
+			__atomic_store_n(&c->out->error, error, __ATOMIC_RELAXED);
+		c->out->pending--;
+		w->queued--;
+		c->next = w->free;
+		w->free = c;
+		pthread_cond_broadcast(&w->done);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+//Start the writer thread of p, chunks are written in place if it cannot be started
+static void tex_writer_start(struct tex_parser *p) {
+	if(p->writer) return;
+
+	struct tex_writer *w = calloc(1, sizeof *w);
+	if(!w) p->error(p, "Could not allocate memory");
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->work, NULL);
+	pthread_cond_init(&w->done, NULL);
+	w->started = pthread_create(&w->thread, NULL, tex_writer_main, w) == 0;
+	p->writer = w;
+}
+
+//Hand the chunk being filled for o to the writer, waiting while too many are queued
+static void tex_out_queue(struct tex_parser *p, struct tex_out *o) {
+	struct tex_writer *w = p->writer;
+	struct tex_out_chunk *c = o->chunk;
+	if(!c) return;
+	o->chunk = NULL;
+
+	if(c->n == 0 || !w->started) {
+		int error = c->n ? tex_out_chunk_write(c) : 0;
+		if(error && !o->error) o->error = error;
+
+		c->next = w->free;
+		w->free = c;
+		return;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	while(w->queued >= TEX_OUT_QUEUE_MAX)
+		pthread_cond_wait(&w->done, &w->lock);
+
+	c->next = NULL;
+	if(w->tail)
+		w->tail->next = c;
+	else
+		w->head = c;
+	w->tail = c;
+	w->queued++;
+	o->pending++;
+
+	pthread_cond_signal(&w->work);
+	pthread_mutex_unlock(&w->lock);
+}
+
+//Wait until the writer has written every chunk queued for o
+static void tex_out_drain(struct tex_parser *p, struct tex_out *o) {
+	struct tex_writer *w = p->writer;
+
+	tex_out_queue(p, o);
+
+	pthread_mutex_lock(&w->lock);
+	while(o->pending > 0)
+		pthread_cond_wait(&w->done, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
+
+//Returns the chunk being filled for o, with room for at least n bytes
+static struct tex_out_chunk *tex_out_room(struct tex_parser *p, struct tex_out *o, size_t n) {
+	assert(n <= TEX_OUT_CHUNK);
+	if(o->chunk && TEX_OUT_CHUNK - o->chunk->n >= n)
+		return o->chunk;
+
+	tex_out_queue(p, o);
+
+	struct tex_writer *w = p->writer;
+	pthread_mutex_lock(&w->lock);
+	struct tex_out_chunk *c = w->free;
+	if(c) w->free = c->next;
+	pthread_mutex_unlock(&w->lock);
+
+	if(!c) c = malloc(sizeof *c);
+	if(!c) p->error(p, "Could not allocate memory");
+
+	*c = (struct tex_out_chunk){o, 0};
+	o->chunk = c;
+	return c;
+}
+
+static void tex_out_append(struct tex_parser *p, struct tex_out *o, const char *s, size_t len) {
+	while(len > 0) {
+		struct tex_out_chunk *c = tex_out_room(p, o, 1);
+		size_t k = TEX_OUT_CHUNK - c->n < len ? TEX_OUT_CHUNK - c->n : len;
+
+		memcpy(c->d + c->n, s, k);
+		c->n += k;
+		s += k;
+		len -= k;
+	}
+}
+
+//Returns open output stream n, reporting a write to it that failed
+static struct tex_out *tex_out_stream(struct tex_parser *p, int n) {
+	assert(n >= 0 && n < 16);
+
+	struct tex_out *o = p->out[n];
+	if(!o)
+		p->error(p, "output stream %i is not open", n);
+
+	int error = __atomic_load_n(&o->error, __ATOMIC_RELAXED);
+	if(error)
+		p->error(p, "could not finish writing to file stream %i: %s", n, strerror(error));
+
+	return o;
+}
+
+//Open filename as output stream n, closing the stream it replaces and dropping what
+//was read ahead of the file. Returns FALSE if the file cannot be opened
+int tex_out_open(struct tex_parser *p, int n, char *filename) {
+	assert(n >= 0 && n < 16);
+
+	tex_out_close(p, n);
+	tex_writer_start(p);
+	tex_prefetch_drop(p, filename);
+
+	struct tex_out *o = calloc(1, sizeof *o);
+	if(!o) p->error(p, "Could not allocate memory");
+
+	o->file = fopen(filename, "w");
+	if(!o->file) {
+		free(o);
+		return FALSE;
+	}
+
+	p->out[n] = o;
+	return TRUE;
+}
+
+void tex_out_write(struct tex_parser *p, int n, const char *s, size_t len) {
+	tex_out_append(p, tex_out_stream(p, n), s, len);
+}
+
+//Write the text of a token list, as tex_tokenlist_as_str() would make it
+void tex_out_tokens(struct tex_parser *p, int n, struct tex_token *t) {
+	struct tex_out *o = tex_out_stream(p, n);
+
+	for(; t; t = t->next) {
+		if(t->cat == TEX_ESC) {
+			struct tex_symbol *sym = &p->symtab.sym[t->sym];
+			tex_out_append(p, o, "\\", 1);
+			tex_out_append(p, o, sym->name, sym->len);
+			continue;
+		}
+
+		struct tex_out_chunk *c = tex_out_room(p, o, 4);
+		c->n += tex_token_str(p, t, c->d + c->n);
+	}
+}
+
+//Close output stream n once everything written to it is in the file, reporting any
+//write that failed
+void tex_out_close(struct tex_parser *p, int n) {
+	assert(n >= 0 && n < 16);
+
+	struct tex_out *o = p->out[n];
+	if(!o) return;
+	p->out[n] = NULL;
+
+	tex_out_drain(p, o);
+
+	int error = o->error;
+	if(fclose(o->file) != 0 && !error)
+		error = errno ? errno : EIO;
+	free(o);
+
+	if(error)
+		p->error(p, "could not finish writing to file stream %i: %s", n, strerror(error));
+}
+
+void tex_out_close_all(struct tex_parser *p) {
+	for(int i = 0; i < 16; i++)
+		tex_out_close(p, i);
+}
+
+//Close the output streams without reporting errors and stop the writer thread
+void tex_out_free(struct tex_parser *p) {
+	struct tex_writer *w = p->writer;
+	if(!w) return;
+
+	for(int i = 0; i < 16; i++) {
+		struct tex_out *o = p->out[i];
+		if(!o) continue;
+
+		tex_out_drain(p, o);
+		fclose(o->file);
+		free(o);
+		p->out[i] = NULL;
+	}
+
+	if(w->started) {
+		pthread_mutex_lock(&w->lock);
+		w->stop = TRUE;
+		pthread_cond_signal(&w->work);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+	}
+
+	while(w->free) {
+		struct tex_out_chunk *c = w->free;
+		w->free = c->next;
+		free(c);
+	}
+
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->work);
+	pthread_cond_destroy(&w->done);
+	free(w);
+	p->writer = NULL;
+}
@@ -1,64 +1,225 @@
 #include <assert.h>
-#include <ctype.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "tex.h"
 
+//Report an error, then give up on the parser. The message is written in one call
+//so messages from parsers on different threads do not interleave
 static void error(struct tex_parser *p, char *fmt, ...){
+	char msg[BUFSIZE];
 	va_list ap;
 	va_start(ap, fmt);
+	vsnprintf(msg, sizeof msg, fmt, ap);
+	va_end(ap);
 
-	fprintf(stderr, "ERR:file \"%s\" line %i col %i:", p->char_stream->name, p->char_stream->line+1, p->char_stream->col+1);
-	vfprintf(stderr, fmt, ap);
-	fprintf(stderr, "\n");
+	if(p->char_stream)
+		fprintf(stderr, "ERR:file \"%s\" line %i col %i:%s\n", p->char_stream->name, p->char_stream->line+1, p->char_stream->col+1, msg);
+	else
+		fprintf(stderr, "ERR:%s\n", msg);
 
+	if(p->recover)
+		longjmp(*p->recover, 1);
+
+	//What was written to output streams is still written, as it was through stdio
+	tex_out_free(p);
 	exit(1);
 }
 
 
+//Returns the current value of t, or NULL if undefined
 struct tex_val *tex_val_find(struct tex_parser *p, struct tex_token t) {
-	struct tex_block *b = p->block;
-	while(b) {
-		size_t n = 0;
-		while(n < b->vals_n)
-			if(strcmp(b->vals[n].cs.s, t.s) == 0) break;
-			else n++;
+	return p->symtab.sym[t.sym].val;
+}
 
-		if(n < b->vals_n)
-			return &b->vals[n];
+//Free a value and drop its reference to the macro body
+static void tex_val_free(struct tex_parser *p, struct tex_val *v) {
+	if(!v) return;
+	tex_macro_release(v->macro);
+	free(v);
+}
+
+static struct tex_val *tex_val_alloc(struct tex_parser *p, struct tex_val v) {
+	struct tex_val *ret = malloc(sizeof *ret);
+	if(!ret) p->error(p, "Could not allocate memory");
+	*ret = v;
+	return ret;
+}
 
-		b = b->parent;
+static void tex_save_push(struct tex_parser *p, struct tex_save s) {
+	if(p->save_n == p->save_cap) {
+		size_t cap = p->save_cap ? 2*p->save_cap : 64;
+		struct tex_save *save = realloc(p->save, cap * sizeof *save);
+		if(!save) p->error(p, "Could not allocate memory");
+		p->save = save;
+		p->save_cap = cap;
 	}
-	return NULL;
+
+	p->save[p->save_n++] = s;
 }
 
+//Define v in the current group, its old value is restored when the group ends
 void tex_val_set(struct tex_parser *p, struct tex_val v) {
 	assert(p);
-	struct tex_val *old_val = tex_val_find(p, v.cs);
-	if(old_val) *old_val = v;
-	else {
-		assert(p->block->vals_n < VAL_MAX);
-		p->block->vals[p->block->vals_n++] = v;
+	assert(v.cs.cat == TEX_ESC);
+
+	struct tex_symbol *s = &p->symtab.sym[v.cs.sym];
+
+	//Only the first definition in a group needs to save the old value
+	if(s->level == p->level)
+		tex_val_free(p, s->val);
+	else
+		tex_save_push(p, (struct tex_save){TEX_SAVE_VAL, .val={v.cs.sym, s->level, s->val}});
+
+	s->val = tex_val_alloc(p, v);
+	s->level = p->level;
+}
+
+//Define v outside of all groups, it survives the end of the current groups
+void tex_val_set_global(struct tex_parser *p, struct tex_val v) {
+	assert(p);
+	assert(v.cs.cat == TEX_ESC);
+
+	struct tex_symbol *s = &p->symtab.sym[v.cs.sym];
+
+	tex_val_free(p, s->val);
+	s->val = tex_val_alloc(p, v);
+	s->level = 0;
+}
+
+//Set the category code of the code point c in the current group
+void tex_catcode_set(struct tex_parser *p, uint32_t c, enum tex_category cat) {
+	if(c > TEX_CODEPOINT_MAX)
+		p->error(p, "Invalid character code %lu", (unsigned long)c);
+
+	if(p->level > 0)
+		tex_save_push(p, (struct tex_save){TEX_SAVE_CAT, .cat={c, tex_catcode(p, c)}});
+
+	tex_catcode_store(p, c, cat);
+}
+
+//Undo one save stack entry
+static void tex_save_restore(struct tex_parser *p, struct tex_save *e) {
+	switch(e->type) {
+	case TEX_SAVE_VAL: {
+		struct tex_symbol *s = &p->symtab.sym[e->val.sym];
+
+		//Global definitions are kept
+		if(s->level == 0) {
+			tex_val_free(p, e->val.val);
+			break;
+		}
+
+		tex_val_free(p, s->val);
+		s->val = e->val.val;
+		s->level = e->val.level;
+		break;
+		}
+	case TEX_SAVE_CAT:
+		tex_catcode_store(p, e->cat.c, e->cat.cat);
+		break;
+	case TEX_SAVE_GROUP:
+		p->save_base = e->base;
+		break;
+	}
+}
+
+//Prepend the contents of fd from offset start as a mapped buffer, returns FALSE
+//if fd is not a regular file or cannot be mapped. fd may be closed afterwards
+static int tex_input_map(struct tex_parser *p, char *name, int fd, off_t start) {
+	struct stat st;
+	if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return FALSE;
+
+	if(start < 0 || start > st.st_size)
+		return FALSE;
+
+	void *map = NULL;
+	size_t map_n = st.st_size;
+	if(map_n > 0) {
+		map = mmap(NULL, map_n, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(map == MAP_FAILED)
+			return FALSE;
 	}
+
+	struct tex_char_stream *s = malloc(sizeof *s);
+	if(!s) p->error(p, "Could not allocate memory");
+
+	name = strdup(name);
+	if(!name) p->error(p, "Could not allocate memory");
+
+	*s = (struct tex_char_stream){TEX_BUF, .name=name, .buf.buf=(char *)map + start, .buf.n=map_n - start,
+		.map=map, .map_n=map_n, .next=p->char_stream};
+
+	p->char_stream = s;
+	return TRUE;
 }
 
 //Prepend contents of given filename to char stream
 //  Filename may be a full path, a file in the CWD, or a file in
 //  the library path. Filename may optionally omit the ".tex" extension
+//  Regular files are mapped in to memory rather than read, unless they
+//  have been read ahead. Files they name are read ahead
 void tex_input(struct tex_parser *p, char *filename){
+	char *buf;
+	size_t n;
+	if(tex_prefetch_take(p, filename, &buf, &n)) {
+		tex_dep_add(p, filename, FALSE);
+		tex_input_borrow(p, filename, buf, n, free, buf);
+		return;
+	}
+
 	//TODO: look for .tex files
-	FILE *f = fopen(filename, "r");
-	if(!f) p->error(p, "Could not input file %s", filename);
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0) p->error(p, "Could not input file %s", filename);
+	tex_dep_add(p, filename, FALSE);
+
+	if(tex_input_map(p, filename, fd, 0)) {
+		close(fd);
+		tex_prefetch_scan(p, p->char_stream->buf.buf, p->char_stream->buf.n);
+		return;
+	}
+
+	FILE *f = fdopen(fd, "r");
+	if(!f) {
+		close(fd);
+		p->error(p, "Could not input file %s", filename);
+	}
 	tex_input_file(p, filename, f);
+	p->char_stream->owned = TRUE;
+}
+
+//Record that the document read or wrote the named file
+void tex_dep_add(struct tex_parser *p, char *name, int output) {
+	for(size_t i = 0; i < p->dep_n; i++)
+		if(p->dep[i].output == output && strcmp(p->dep[i].name, name) == 0)
+			return;
+
+	struct tex_dep *dep = realloc(p->dep, (p->dep_n + 1) * sizeof *dep);
+	if(!dep) p->error(p, "Could not allocate memory");
+	p->dep = dep;
+
+	name = strdup(name);
+	if(!name) p->error(p, "Could not allocate memory");
+	p->dep[p->dep_n++] = (struct tex_dep){name, output};
 }
 
 //Prepend contents of file stream to char stream
+//  Regular files are mapped from the current file position, the stream itself
+//  is left untouched. Other files, such as pipes, are read character by character
 void tex_input_file(struct tex_parser *p, char *name, FILE *file){
 	assert(p);
 	assert(file);
 
+	long start = ftell(file);
+	if(start >= 0 && tex_input_map(p, name, fileno(file), start))
+		return;
+
 	struct tex_char_stream *s = malloc(sizeof *s);
 	if(!s) p->error(p, "Could not allocate memory");
 
@@ -70,21 +231,50 @@ void tex_input_file(struct tex_parser *p, char *name, FILE *file){
 	p->char_stream = s;
 }
 
-//Prepend a buffer of characters to the character stream
+//Free a character stream, closing the file or mapping it reads from
+static void tex_char_stream_free(struct tex_char_stream *s) {
+	if(s->type == TEX_FILE) {
+		if(s->owned) fclose(s->file);
+	} else if(s->map)
+		munmap(s->map, s->map_n);
+	else if(s->release)
+		s->release(s->release_ctx);
+
+	free(s->name);
+	free(s);
+}
+
+//Prepend a buffer of characters to the character stream, the buffer is copied
 void tex_input_buf(struct tex_parser *p, char *name, char *buf, size_t n) {
 	assert(p);
 	assert(buf);
 
-	struct tex_char_stream *s = malloc(sizeof *s);
-	if(!s) p->error(p, "Could not allocate memory");
-
-	void *mybuf = malloc(n);
+	char *mybuf = malloc(n ? n : 1);
+	if(!mybuf) p->error(p, "Could not allocate memory");
 	memcpy(mybuf, buf, n);
 
-	name = strdup(name);
-	if(!name) p->error(p, "Could not allocate memory");
+	tex_input_borrow(p, name, mybuf, n, free, mybuf);
+}
 
-	*s = (struct tex_char_stream){TEX_BUF, .name=name, .buf.buf=mybuf, .buf.n=n, .next=p->char_stream};
+//Prepend a buffer of characters to the character stream without copying it. The
+//stream calls release with ctx once it has been read or the parser is freed, and the
+//buffer has to stay valid until then. If release is NULL the buffer must outlive the
+//parser. The buffer is released here if the stream can not be made
+void tex_input_borrow(struct tex_parser *p, char *name, char *buf, size_t n, void (*release)(void *), void *ctx) {
+	assert(p);
+	assert(buf);
+
+	struct tex_char_stream *s = malloc(sizeof *s);
+	char *myname = strdup(name);
+	if(!s || !myname) {
+		free(s);
+		free(myname);
+		if(release) release(ctx);
+		p->error(p, "Could not allocate memory");
+	}
+
+	*s = (struct tex_char_stream){TEX_BUF, .name=myname, .buf.buf=buf, .buf.n=n,
+		.release=release, .release_ctx=ctx, .next=p->char_stream};
 
 	p->char_stream = s;
 }
@@ -94,9 +284,146 @@ void tex_input_str(struct tex_parser *p, char *name, char *input){
 	tex_input_buf(p, name, input, strlen(input));
 }
 
+//Remove the top input frame, freeing what it still holds
+static void tex_frame_pop(struct tex_parser *p) {
+	struct tex_frame *f = p->input;
+	assert(f);
+	p->input = f->parent;
+	p->input_n--;
+
+	if(p->profile && f->type == TEX_FRAME_MACRO)
+		tex_profile_frame(p, f);
+
+	tex_token_free(p, f->token);
+	tex_seq_release(f->seq);
+	if(f->macro) {
+		for(int i = 0; i < 9; i++)
+			tex_seq_release(f->parameter[i]);
+		tex_macro_release(f->macro);
+	}
+
+	f->parent = p->frame_free;
+	p->frame_free = f;
+}
+
+//Returns TRUE if nothing is left to read from f
+static int tex_frame_done(struct tex_frame *f) {
+	switch(f->type) {
+	case TEX_FRAME_TOKENS: return f->token == NULL;
+	case TEX_FRAME_SEQ: return f->i == f->seq->n;
+	case TEX_FRAME_MACRO: return f->op == f->macro->op_n;
+	}
+	return FALSE;
+}
+
+//Push a frame, popping any finished ones first. A macro called by the last token of
+//another one's body replaces that body's frame, so loops written as tail calls read
+//their input in constant space
+static struct tex_frame *tex_frame_push(struct tex_parser *p, enum tex_frame_type type) {
+	while(p->input && tex_frame_done(p->input))
+		tex_frame_pop(p);
+
+	struct tex_frame *f = p->frame_free;
+	if(f)
+		p->frame_free = f->parent;
+	else {
+		f = malloc(sizeof *f);
+		if(!f) p->error(p, "Could not allocate memory");
+	}
+
+	*f = (struct tex_frame){type, .parent=p->input};
+	p->input = f;
+	p->input_n++;
+	return f;
+}
+
+//Prepend a token list to start of token input, the list is owned by the input afterwards
+void tex_input_list(struct tex_parser *p, struct tex_token *ts) {
+	if(!ts) return;
+
+	if(p->input && p->input->type == TEX_FRAME_TOKENS)
+		p->input->token = tex_token_join(ts, p->input->token);
+	else
+		tex_frame_push(p, TEX_FRAME_TOKENS)->token = ts;
+}
+
 //Prepend one token to start of token input
 void tex_input_token(struct tex_parser *p, struct tex_token t) {
-	p->token = tex_token_prepend(t, p->token);
+	tex_input_list(p, tex_token_alloc(p, t));
+}
+
+//Prepend the expansion of macro body m with the given arguments to the token input.
+//The arguments are owned by the input afterwards, each one is stored once and shared
+//by every use of its parameter
+void tex_input_macro(struct tex_parser *p, struct tex_macro *m, struct tex_seq **parameter) {
+	struct tex_frame *f = tex_frame_push(p, TEX_FRAME_MACRO);
+
+	f->macro = m;
+	m->ref++;
+	memcpy(f->parameter, parameter, sizeof f->parameter);
+}
+
+//Read the next token from the token input, returns FALSE if there is none
+static int tex_read_input_token(struct tex_parser *p, struct tex_token *t) {
+	struct tex_frame *f;
+
+	while((f = p->input)) {
+		if(f->type == TEX_FRAME_TOKENS) {
+			struct tex_token *n = f->token;
+			if(!n) {
+				tex_frame_pop(p);
+				continue;
+			}
+
+			//Tokens read are never linked to the rest of the list
+			*t = *n;
+			t->next = t->prev = NULL;
+			f->token = n->next;
+			if(f->token) f->token->prev = NULL;
+			tex_token_release(p, n);
+			p->input_token_n++;
+			return TRUE;
+		}
+
+		if(f->type == TEX_FRAME_SEQ) {
+			if(f->i == f->seq->n) {
+				tex_frame_pop(p);
+				continue;
+			}
+
+			*t = tex_token_unpack(f->seq->tok[f->i++]);
+			p->input_token_n++;
+			return TRUE;
+		}
+
+		//TEX_FRAME_MACRO
+		struct tex_macro *m = f->macro;
+		if(f->op == m->op_n) {
+			tex_frame_pop(p);
+			continue;
+		}
+
+		struct tex_macro_op *op = &m->op[f->op];
+		if(op->type == TEX_OP_PARAM) {
+			struct tex_seq *arg = f->parameter[op->n-1];
+			f->op++;
+			if(arg) {
+				arg->ref++;
+				tex_frame_push(p, TEX_FRAME_SEQ)->seq = arg;
+			}
+			continue;
+		}
+
+		*t = tex_token_unpack(m->tok[op->i + f->i++]);
+		if(f->i == op->n) {
+			f->op++;
+			f->i = 0;
+		}
+		p->input_token_n++;
+		return TRUE;
+	}
+
+	return FALSE;
 }
 
 //Input at most n tokens from token stream to start of token input
@@ -117,245 +444,276 @@ void tex_input_tokens(struct tex_parser *p, struct tex_token *ts, size_t n) {
 void tex_init_parser(struct tex_parser *p){
 	assert(p);
 	memset(p, 0, sizeof *p);
-
-	p->block = malloc(sizeof *p->block);
-	if(!p->block) p->error(p, "Could not allocate memory");
-	memset(p->block, 0, sizeof *p->block);
+	p->error = error;
 
 	//Set default character codes
 	//Note: 0 -> other, 12 -> esc internally
-	p->block->cat['{'] = TEX_BEGIN_GROUP;
-	p->block->cat['}'] = TEX_END_GROUP;
-	p->block->cat['$'] = TEX_MATH;
-	p->block->cat['&'] = TEX_ALIGN;
-	p->block->cat['\n'] = TEX_EOL;
-	p->block->cat['#'] = TEX_PARAMETER;
-	p->block->cat['^'] = TEX_SUPER;
-	p->block->cat['_'] = TEX_SUB;
-	p->block->cat['\0'] = TEX_INVALID;
-	p->block->cat[' '] = TEX_SPACE;
-	p->block->cat['\t'] = TEX_SPACE;
-	p->block->cat['\\'] = TEX_ESC;
-	p->block->cat['~'] = TEX_ACTIVE;
-	p->block->cat['%'] = TEX_COMMENT;
-	p->block->cat[127] = TEX_INVALID;
-
-	p->map[0].in = "---";
-	p->map[0].out = "—";
-	p->map[1].in = "--";
-	p->map[1].out = "–";
-	p->map[2].in = "`";
-	p->map[2].out = "‘";
-	p->map[3].in = "``";
-	p->map[3].out = "“";
-	p->map[4].in = "'";
-	p->map[4].out = "’";
-	p->map[5].in = "''";
-	p->map[5].out = "”";
-	p->map[6].in = "\1";
-	p->map[6].out = "'";
-	p->map[7].in = "\2";
-	p->map[7].out = "\"";
+	p->cat['{'] = TEX_BEGIN_GROUP;
+	p->cat['}'] = TEX_END_GROUP;
+	p->cat['$'] = TEX_MATH;
+	p->cat['&'] = TEX_ALIGN;
+	p->cat['\n'] = TEX_EOL;
+	p->cat['#'] = TEX_PARAMETER;
+	p->cat['^'] = TEX_SUPER;
+	p->cat['_'] = TEX_SUB;
+	p->cat['\0'] = TEX_INVALID;
+	p->cat[' '] = TEX_SPACE;
+	p->cat['\t'] = TEX_SPACE;
+	p->cat['\\'] = TEX_ESC;
+	p->cat['~'] = TEX_ACTIVE;
+	p->cat['%'] = TEX_COMMENT;
+	p->cat[127] = TEX_INVALID;
+
+	tex_map_init(p);
+	tex_map_add(p, "---", "—");
+	tex_map_add(p, "--", "–");
+	tex_map_add(p, "`", "‘");
+	tex_map_add(p, "``", "“");
+	tex_map_add(p, "'", "’");
+	tex_map_add(p, "''", "”");
+	tex_map_add(p, "\1", "'");
+	tex_map_add(p, "\2", "\"");
 
 	char c;
-	for (c = 'A'; c <= 'Z'; c++) p->block->cat[(size_t)c] = TEX_LETTER;
-	for (c = 'a'; c <= 'z'; c++) p->block->cat[(size_t)c] = TEX_LETTER;
+	for (c = 'A'; c <= 'Z'; c++) p->cat[(size_t)c] = TEX_LETTER;
+	for (c = 'a'; c <= 'z'; c++) p->cat[(size_t)c] = TEX_LETTER;
+
+	tex_scan_init(&p->scan);
+	tex_symtab_init(p);
+	p->sym_par = tex_symbol(p, "par");
+	p->sym_else = tex_symbol(p, "else");
+	p->sym_fi = tex_symbol(p, "fi");
+	p->sym_iftrue = tex_symbol(p, "iftrue");
+	p->sym_iffalse = tex_symbol(p, "iffalse");
+}
 
+//Initialize p with the definitions, category codes, glyph map and handlers of template,
+//but none of its input. Macro bodies are shared, so template must outlive p and
+//neither may be used on another thread while the other is in use. The error handler,
+//recover and error_ctx of p are set by the caller, errors while copying go to them and p can
+//be freed afterwards
+void tex_clone_parser(struct tex_parser *p, struct tex_parser *template) {
+	assert(p && template);
+	void (*error)(struct tex_parser *, char *fmt, ...) = p->error;
+	jmp_buf *recover = p->recover;
+	void *error_ctx = p->error_ctx;
+	memset(p, 0, sizeof *p);
 	p->error = error;
-}
+	p->recover = recover;
+	p->error_ctx = error_ctx;
 
-//Add another level to the macro call stack, name it with given macro token
-void tex_stack_enter(struct tex_parser *p, struct tex_token macro) {
-	struct tex_stack *s = malloc(sizeof *s);
-	if(!s) p->error(p, "Could not allocate memory");
-	memset(s, 0, sizeof *s);
+	if(template->level > 0)
+		p->error(p, "Cannot copy a parser inside a group");
 
-	s->macro = macro;
-	s->parent = p->stack;
-	p->stack = s;
-}
+	memcpy(p->cat, template->cat, sizeof p->cat);
+	tex_cat_pages_copy(p, template);
+	tex_map_copy(p, template);
+	tex_scan_init(&p->scan);
+	tex_symtab_copy(p, template);
 
-void tex_stack_exit(struct tex_parser *p) {
-	assert(p && p->stack);
+	for(unsigned id = 1; id < p->symtab.n; id++) {
+		struct tex_val *v = template->symtab.sym[id].val;
+		if(!v) continue;
 
-	struct tex_stack *s = p->stack;
-	p->stack = s->parent;
+		struct tex_val *copy = tex_val_alloc(p, *v);
+		if(copy->macro) copy->macro->ref++;
+		p->symtab.sym[id].val = copy;
+	}
 
-	for(int i = 0; i < 9; i++)
-		if(s->parameter[i])
-			tex_token_free(s->parameter[i]);
+	p->handler = malloc(template->handler_n * sizeof *p->handler);
+	if(template->handler_n && !p->handler) p->error(p, "Could not allocate memory");
+	memcpy(p->handler, template->handler, template->handler_n * sizeof *p->handler);
+	p->handler_n = template->handler_n;
 
-	free(s);
+	p->sym_par = template->sym_par;
+	p->sym_else = template->sym_else;
+	p->sym_fi = template->sym_fi;
+	p->sym_iftrue = template->sym_iftrue;
+	p->sym_iffalse = template->sym_iffalse;
 }
 
-
+//Start a new group, definitions made in it are undone by tex_block_exit()
 void tex_block_enter(struct tex_parser *p) {
-	struct tex_block *b = malloc(sizeof *b);
-	if(!b) p->error(p, "Could not allocate memory");
-	memset(b, 0, sizeof *b);
-
-	for(int i = 0; i < 127; i++)
-		b->cat[i] = p->block->cat[i];
-
-	b->parent = p->block;
-	p->block = b;
+	tex_save_push(p, (struct tex_save){TEX_SAVE_GROUP, .base=p->save_base});
+	p->save_base = p->save_n - 1;
+	p->level++;
+	p->group_n++;
 }
 
 void tex_block_exit(struct tex_parser *p) {
-	assert(p && p->block);  //There should always be a block defined
-	if(!p->block->parent)
+	assert(p);
+	if(p->level == 0)
 		p->error(p, "Extraneous group close");
 
-	struct tex_block *b = p->block;
-	p->block = b->parent;
+	size_t base = p->save_base;
+	while(p->save_n > base)
+		tex_save_restore(p, &p->save[--p->save_n]);
 
-	free(b);
+	p->level--;
 }
 
 
-void tex_define_macro_func(struct tex_parser *p, char *cs, struct tex_token * (*handler)(struct tex_parser*, struct tex_val)){
-	tex_val_set(p, (struct tex_val){TEX_MACRO, (struct tex_token){TEX_ESC, .s=cs}, .handler=handler});
+static void tex_define_handler(struct tex_parser *p, char *cs, struct tex_token * (*handler)(struct tex_parser*, struct tex_val), int conditional){
+	unsigned sym = tex_symbol(p, cs);
+	tex_val_set(p, (struct tex_val){TEX_MACRO, (struct tex_token){TEX_ESC, .sym=sym}, .handler=handler, .conditional=conditional});
+
+	size_t i = 0;
+	while(i < p->handler_n && p->handler[i].sym != sym)
+		i++;
+
+	if(i == p->handler_n) {
+		struct tex_handler *h = realloc(p->handler, (p->handler_n + 1) * sizeof *h);
+		if(!h) p->error(p, "Could not allocate memory");
+		p->handler = h;
+		p->handler_n++;
+	}
+	p->handler[i] = (struct tex_handler){sym, handler, conditional};
 }
 
-//Parses macro arguments from parser input based on the given arglist and writes the
-//arguments to the supplied buffer, which must be large enough to accomidate all numbered
-//arguments in the arglist
-void tex_parse_arguments(struct tex_parser *p, struct tex_token *arglist) {
-	assert(p && p->stack);
+//Define cs as a C handler and register the handler under that name
+void tex_define_macro_func(struct tex_parser *p, char *cs, struct tex_token * (*handler)(struct tex_parser*, struct tex_val)){
+	tex_define_handler(p, cs, handler, FALSE);
+}
 
-	//Nothing to do for empty arglist
-	if(!arglist) return;
+//Define cs as a C handler that starts a conditional. Skipped text is searched for these
+//to find the \fi that ends a conditional
+void tex_define_conditional(struct tex_parser *p, char *cs, struct tex_token * (*handler)(struct tex_parser*, struct tex_val)){
+	tex_define_handler(p, cs, handler, TRUE);
+}
 
+//Reads the rest of a group whose begin group token has been read, without its end group
+static struct tex_token *tex_read_group(struct tex_parser *p) {
 	struct tex_token t;
-	while(arglist && arglist->cat != TEX_PARAMETER){
-		t = tex_read_token(p);
+	struct tex_token_list ts = {0};
+	int group = 0;
+
+	while((t = tex_read_token(p)).cat != TEX_END_GROUP || group > 0) {
 		if(t.cat == TEX_INVALID)
-			p->error(p, "Input ends while reading macro arguments");
+			p->error(p, "Input ends inside a group");
+		if(t.cat == TEX_BEGIN_GROUP) group++;
+		if(t.cat == TEX_END_GROUP) group--;
+		tex_token_list_append(p, &ts, t);
+	}
 
-		if(!tex_token_eq(*arglist, t))
-			p->error(p, "Macro usage does not match definition, expected '%s' (%i) but got '%s' (%i)", tex_tokenlist_as_str(arglist), arglist->cat, tex_tokenlist_as_str(&t), t.cat);
+	return ts.head;
+}
 
-		arglist = arglist->next;
-	}
+//Parses macro arguments from parser input against the parameter text of m and writes
+//them to the supplied buffer, which must have room for m->param_n arguments. Input is
+//read once, front to back: a partly matched delimiter falls back through m->fail
+//instead of pushing tokens back, so reading an argument is linear in its length
+void tex_parse_arguments(struct tex_parser *p, struct tex_macro *m, struct tex_seq **parameter) {
+	assert(p);
+
+	tex_packed *arg = m->arg;
+	struct tex_token t;
+	size_t i = 0;
 
-	struct tex_token *bound_start = arglist;
-	size_t i = 0, /*arg number*/
-	       n = 0, /*bounding characters matched*/
-	       s = 0; /*start of rewind*/
-	int g = 0; /*grouping level of parameter text*/
-	while(arglist != NULL) {
+	//Tokens before the first parameter have to match as they are
+	for(; i < m->arg_n && tex_packed_cat(arg[i]) != TEX_PARAMETER; i++) {
 		t = tex_read_token(p);
 		if(t.cat == TEX_INVALID)
 			p->error(p, "Input ends while reading macro arguments");
-		if(t.cat == TEX_PARAMETER)
-			p->error(p, "Parameter used outside of macro definition");
-
-		if(arglist->cat == TEX_PARAMETER){
-			arglist = arglist->next;
-			i++;
-
-			//If this is a undelimited parameter
-			if(arglist == NULL || arglist->cat == TEX_PARAMETER){
-				//Groups are read as a single parameter
-				if(t.cat == TEX_BEGIN_GROUP) {
-					tex_input_token(p, t);
-					p->stack->parameter[i-1] = tex_read_block(p);
-				} else {
-					//This token (or group) is the parameter
-					p->stack->parameter[i-1] = tex_token_alloc(t);
-				}
-
-				continue;
-			}
-
-
-			//This is a delimited parameter
-			//Initialize new boundary search parameters
-			n = 0;
-			s = 0;
-			g = 0;
-			bound_start = arglist;
 
+		if(tex_token_pack(t) != arg[i]) {
+			struct tex_token e = tex_token_unpack(arg[i]);
+			p->error(p, "Macro usage does not match definition, expected '%s' (%i) but got '%s' (%i)", tex_tokenlist_as_str(p, &e), e.cat, tex_tokenlist_as_str(p, &t), t.cat);
 		}
+	}
 
-		//Keep track of group balancing
-		if(t.cat == TEX_BEGIN_GROUP) g++;
-		if(t.cat == TEX_END_GROUP) g--;
+	//Arguments are read one after another in to argbuf, and only copied out once all
+	//of them have been read
+	struct tex_tokvec *v = &p->argbuf;
+	size_t start[10];
+	int k = 0;
+
+	v->n = 0;
+	for(; i < m->arg_n; k++) {
+		//The delimiter of this parameter runs up to the next one
+		size_t d = ++i;
+		while(i < m->arg_n && tex_packed_cat(arg[i]) != TEX_PARAMETER)
+			i++;
+		size_t n = i - d;
+
+		start[k] = v->n;
+		size_t q = 0; //Delimiter tokens matched
+		int g = 0; //Grouping level of parameter text
+		for(;;) {
+			t = tex_read_token(p);
+			if(t.cat == TEX_INVALID)
+				p->error(p, "Input ends while reading macro arguments");
+			if(t.cat == TEX_PARAMETER)
+				p->error(p, "Parameter used outside of macro definition");
 
-		if(g < 0) p->error(p, "unbalanced end group  while reading parameter");
+			tex_packed c = tex_token_pack(t);
+			if(t.cat == TEX_BEGIN_GROUP) g++;
+			if(t.cat == TEX_END_GROUP) g--;
+			if(g < 0) p->error(p, "unbalanced end group  while reading parameter");
 
-		if(arglist && g == 0 && tex_token_eq(*arglist, t)){
-			//Token matches boundry, keep reading
-			arglist = arglist->next;
-			if(s == 0 && n > 0 && tex_token_eq(t, *bound_start))
-				s = n;
-			n++;
-		} else { //Token does not match boundary token
+			//Undelimited parameters take one token, or a group without its braces
 			if(n == 0) {
-				//No boundry tokens match so far, append this token to parameter
-				p->stack->parameter[i-1] = tex_token_append(p->stack->parameter[i-1], t);
-			}else{ //Some boundary tokens have been matched and consumed
-				//Rewind arglist to bound_start
-				arglist = bound_start;
-
-				//Copy s items (or all if no s) to the argument
-				//These are the items that we know do not match
-				//the boundary and can be skipped
-				s = s?s:n;
-				for(int t = s; t > 0; t--) {
-					p->stack->parameter[i-1] = tex_token_append(p->stack->parameter[i-1], *arglist);
-					arglist = arglist->next;
+				if(g == 0) {
+					if(t.cat != TEX_END_GROUP)
+						tex_tokvec_push(p, v, c);
+					break;
 				}
+				if(t.cat != TEX_BEGIN_GROUP || g > 1)
+					tex_tokvec_push(p, v, c);
+				continue;
+			}
 
-				//Add unskipped items to the front of the input
-				tex_input_token(p, t);
-				tex_input_tokens(p, arglist, n-s);
-
-				//Start looking for bound again
-				arglist = bound_start;
-				n = 0;
-				s = 0;
+			//Fall back to the longest matched part of the delimiter that t extends,
+			//tokens that drop out of the match belong to the argument
+			size_t r = g == 0 ? q : 0;
+			while(r > 0 && arg[d+r] != c)
+				r = m->fail[d+r-1];
+			for(size_t j = 0; j < q - r; j++)
+				tex_tokvec_push(p, v, arg[d+j]);
+
+			if(g == 0 && arg[d+r] == c) {
+				q = r + 1;
+			} else {
+				q = 0;
+				tex_tokvec_push(p, v, c);
 			}
+
+			if(q == n) break;
 		}
 	}
+
+	start[k] = v->n;
+	for(int j = 0; j < k; j++)
+		parameter[j] = tex_seq_from_array(p, v->tok + start[j], start[j+1] - start[j]);
 }
 
 //Returns an arglist parsed from the parser input. This is what would follow a \def, as in
 //\def\cs<arglist>{<replacement>}
 struct tex_token *tex_parse_arglist(struct tex_parser *p) {
 	int pn = 1; //parameter number
-	struct tex_token t, *ts = NULL;
+	struct tex_token t;
+	struct tex_token_list ts = {0};
 
 	while((t = tex_read_token(p)).cat != TEX_BEGIN_GROUP) {
 		if(t.cat == TEX_INVALID) break;
 		if(t.cat == TEX_PARAMETER && t.c != pn++)
 			p->error(p, "Paramater numbers should increase sequentially");
-		ts = tex_token_append(ts, t);
+		tex_token_list_append(p, &ts, t);
 	}
 
 	tex_input_token(p, t);
 
-	return ts;
+	return ts.head;
 }
 
 //Reads one balanced block of tokens, or NULL if next token is not a TEX_BEGIN_GROUP
 struct tex_token *tex_read_block(struct tex_parser *p) {
 	struct tex_token t = tex_read_token(p);
 	if(t.cat != TEX_BEGIN_GROUP){
-		p->token = tex_token_prepend(t, p->token);
+		tex_input_token(p, t);
 		return NULL;
 	}
 
-	struct tex_token *ts = NULL;
-	int group = 0;
-
-	while((t = tex_read_token(p)).cat != TEX_END_GROUP || group > 0) {
-		if(t.cat == TEX_BEGIN_GROUP) group++;
-		if(t.cat == TEX_END_GROUP) group--;
-		ts = tex_token_append(ts, t);
-	}
-
-	return ts;
+	return tex_read_group(p);
 }
 
 //Expand token if it is expandable, otherwise return NULL;
@@ -373,48 +731,44 @@ struct tex_token *tex_expand_token(struct tex_parser *p, struct tex_token t) {
 //Reads one balanced block of tokens, or NULL if next token is not a TEX_BEGIN_GROUP
 //Expands tokens inside block if able
 struct tex_token *tex_read_and_expand_block(struct tex_parser *p) {
-	struct tex_token t = tex_read_token(p), *ret = NULL;
-
-	tex_block_enter(p);
-	struct tex_block *start_block = p->block;
+	struct tex_token t = tex_read_token(p);
+	struct tex_token_list ret = {0};
 
 	if(t.cat != TEX_BEGIN_GROUP){
-		p->token = tex_token_prepend(t, p->token);
+		tex_input_token(p, t);
 		return NULL;
 	}
 
-	while((t = tex_read_token(p)).cat != TEX_END_GROUP || p->block != start_block) {
+	tex_block_enter(p);
+	int level = p->level;
+
+	while((t = tex_read_token(p)).cat != TEX_END_GROUP || p->level != level) {
 		switch(t.cat) {
-		case TEX_ESC:	//fallthrough
-		case TEX_PARAMETER: {
-			struct tex_token *expansion = tex_expand_token(p, t);
-			p->token = tex_token_join(expansion, p->token);
-			continue;
-			}
+		case TEX_ESC: tex_input_list(p, tex_expand_token(p, t)); continue;
 		case TEX_BEGIN_GROUP: tex_block_enter(p); break;
 		case TEX_END_GROUP: tex_block_exit(p); break;
-		case TEX_STACK_POP: tex_stack_exit(p); break;
-		default: ret = tex_token_append(ret, t);
+		default: tex_token_list_append(p, &ret, t);
 		}
 	}
 
 	tex_block_exit(p);
 
-	return ret;
+	return ret.head;
 }
 
 #define ENDGROUP (struct tex_token){TEX_END_GROUP, .c='}'}
 #define EOL (struct tex_token){TEX_OTHER, .c='\n'}
-#define STACK_POP (struct tex_token){TEX_STACK_POP}
 
 //Handle a general purpose macro, such as those previously defined by \def
+//The compiled body is read in place from the input stack
 struct tex_token *tex_handle_macro_general(struct tex_parser* p, struct tex_val m){
 	assert(p);
 
-	tex_stack_enter(p, m.cs);
-	tex_parse_arguments(p, m.arglist);
+	struct tex_seq *parameter[9] = {0};
+	tex_parse_arguments(p, m.macro, parameter);
+	tex_input_macro(p, m.macro, parameter);
 
-	return tex_token_join(tex_token_copy(m.replacement), tex_token_alloc(STACK_POP));
+	return NULL;
 }
 
 struct tex_token *tex_handle_macro_par(struct tex_parser* p, struct tex_val m){
@@ -423,44 +777,43 @@ struct tex_token *tex_handle_macro_par(struct tex_parser* p, struct tex_val m){
 }
 
 struct tex_token *tex_handle_macro_dollarsign(struct tex_parser* p, struct tex_val m){
-	return tex_token_alloc((struct tex_token){TEX_OTHER, .c='$'});
+	return tex_token_alloc(p, (struct tex_token){TEX_OTHER, .c='$'});
 }
 
 struct tex_token *tex_handle_macro_singlequote(struct tex_parser* p, struct tex_val m){
-	return tex_token_alloc((struct tex_token){TEX_OTHER, .c=1});
+	return tex_token_alloc(p, (struct tex_token){TEX_OTHER, .c=1});
 }
 
 struct tex_token *tex_handle_macro_doublequote(struct tex_parser* p, struct tex_val m){
-	return tex_token_alloc((struct tex_token){TEX_OTHER, .c=2});
+	return tex_token_alloc(p, (struct tex_token){TEX_OTHER, .c=2});
 }
 
 struct tex_token *tex_handle_macro_percent(struct tex_parser* p, struct tex_val m){
-	return tex_token_alloc((struct tex_token){TEX_OTHER, .c='%'});
+	return tex_token_alloc(p, (struct tex_token){TEX_OTHER, .c='%'});
 }
 
 struct tex_token *tex_handle_macro_hash(struct tex_parser* p, struct tex_val m){
-	return tex_token_alloc((struct tex_token){TEX_OTHER, .c='#'});
+	return tex_token_alloc(p, (struct tex_token){TEX_OTHER, .c='#'});
 }
 
 struct tex_token *tex_handle_macro_amp(struct tex_parser* p, struct tex_val m){
-	return tex_token_alloc((struct tex_token){TEX_OTHER, .c='&'});
+	return tex_token_alloc(p, (struct tex_token){TEX_OTHER, .c='&'});
 }
 
 struct tex_token *tex_handle_macro_space(struct tex_parser* p, struct tex_val m){
-	return tex_token_alloc((struct tex_token){TEX_OTHER, .c=' '});
+	return tex_token_alloc(p, (struct tex_token){TEX_OTHER, .c=' '});
 }
 
 //Handle \def macros
 struct tex_token *tex_handle_macro_def(struct tex_parser* p, struct tex_val m){
 	struct tex_token cs = tex_read_token(p);
-	cs.next = NULL;
 	if(cs.cat != TEX_ESC)
-		p->error(p, "Expected escape sequence after %s, got %s", tex_tokenlist_as_str(&m.cs), tex_tokenlist_as_str(&cs));
+		p->error(p, "Expected escape sequence after %s, got %s", tex_tokenlist_as_str(p, &m.cs), tex_tokenlist_as_str(p, &cs));
 
 	struct tex_token *arglist = tex_parse_arglist(p);
 	struct tex_token *replacement = tex_read_block(p);
 
-	tex_define_macro_tokens(p, cs.s, arglist, replacement);
+	tex_define_macro_tokens(p, cs.sym, arglist, replacement);
 
 	return NULL;
 }
@@ -472,7 +825,7 @@ struct tex_token *tex_handle_macro_edef(struct tex_parser* p, struct tex_val m){
 	struct tex_token *arglist = tex_parse_arglist(p);
 	struct tex_token *replacement = tex_read_and_expand_block(p);
 
-	tex_define_macro_tokens(p, cs.s, arglist, replacement);
+	tex_define_macro_tokens(p, cs.sym, arglist, replacement);
 
 	return NULL;
 }
@@ -484,84 +837,259 @@ struct tex_token *tex_handle_macro_global(struct tex_parser *p, struct tex_val m
 }
 
 struct tex_token *tex_handle_macro_input(struct tex_parser* p, struct tex_val m){
-	char *filename = tex_tokenlist_as_str(tex_read_block(p));
+	struct tex_token *block = tex_read_block(p);
+	char *filename = tex_tokenlist_as_str(p, block);
+	tex_token_free(p, block);
+
 	tex_input(p, filename);
+	free(filename);
 	return NULL;
 }
 
-#define ELSE (struct tex_token){TEX_ESC, .s="else"}
-#define FI (struct tex_token){TEX_ESC, .s="fi"}
+//Skip characters of a branch that is not taken up to the next control sequence. Only
+//the escape and comment characters are looked at, buffers are passed over in place,
+//bytes above ASCII too while none of those characters have a category code.
+//Returns the id of the control sequence, or 0 if its name has never been interned and
+//so can not be a conditional, or if there was none
+static unsigned tex_skip_chars(struct tex_parser *p) {
+	struct tex_char_stream *s = p->char_stream;
+	if(!s) p->error(p, "Input ends inside a conditional");
+
+	if(s->type == TEX_BUF) {
+		size_t i = s->buf.i, cont = 0;
+		for(; i < s->buf.n; i++) {
+			unsigned char c = s->buf.buf[i];
+			if(c < 128) {
+				if(p->cat[c] == TEX_ESC || p->cat[c] == TEX_COMMENT)
+					break;
+				if(c == '\n') {
+					s->line++;
+					s->col = 0;
+				} else
+					s->col++;
+			} else {
+				if(p->cat_page) break;
+
+				//Continuation bytes are part of the character before them
+				if((c & 0xc0) == 0x80)
+					cont++;
+				else
+					s->col++;
+			}
+		}
 
-struct tex_token *tex_handle_macro_iffalse(struct tex_parser* p, struct tex_val m){
-	struct tex_token t, *ret = NULL;
+		p->char_n += i - s->buf.i - cont;
+		s->buf.i = i;
+	}
 
-	while(t = tex_read_token(p), !tex_token_eq(t, ELSE) && !tex_token_eq(t, FI));
+	struct tex_token t = tex_read_char(p);
 
-	if(tex_token_eq(t, FI)) return NULL;
+	if(t.cat == TEX_COMMENT) {
+		while(t.cat != TEX_EOL && p->char_stream)
+			t = tex_read_char(p);
+		return 0;
+	}
 
-	while(t = tex_read_token(p), !tex_token_eq(t, FI))
-		ret = tex_token_append(ret, t);
+	if(t.cat != TEX_ESC)
+		return 0;
 
-	return ret;
+	//Only names made of letters can be conditionals, \else or \fi
+	char buf[CS_MAX+4];
+	size_t n = 0;
+	while((t = tex_read_char(p)).cat == TEX_LETTER) {
+		if(n < CS_MAX) n += tex_utf8_encode(t.c, &buf[n]);
+		else n++;
+	}
+	if(n == 0)
+		return 0;
+
+	tex_unread_char(p);
+	p->state = TEX_SKIPSPACE;
+	return n <= CS_MAX ? tex_symbol_find(p, buf, n) : 0;
+}
+
+//Skip a branch that is not taken, up to the \fi ending the conditional, or to an \else
+//at the same level if to_else is TRUE. Returns TRUE if it stopped at an \else.
+//Conditionals in the skipped text are counted, so their \else and \fi are skipped too
+static int tex_skip_conditional(struct tex_parser *p, int to_else) {
+	size_t nest = 0;
+
+	for(;;) {
+		struct tex_token t;
+		unsigned sym;
+
+		if(tex_read_input_token(p, &t)) {
+			if(t.cat != TEX_ESC) continue;
+			sym = t.sym;
+		} else if(!(sym = tex_skip_chars(p)))
+			continue;
+
+		if(sym == p->sym_fi) {
+			if(nest == 0) return FALSE;
+			nest--;
+		} else if(sym == p->sym_else) {
+			if(nest == 0 && to_else) return TRUE;
+		} else if(p->symtab.sym[sym].val && p->symtab.sym[sym].val->conditional)
+			nest++;
+	}
+}
+
+//The true branch of a conditional is read as normal input, its end is handled by the
+//\else or \fi that follows it
+struct tex_token *tex_handle_macro_iffalse(struct tex_parser* p, struct tex_val m){
+	p->cond_n++;
+	if(!tex_skip_conditional(p, TRUE))
+		p->cond_n--;
+	return NULL;
 }
 
 struct tex_token *tex_handle_macro_iftrue(struct tex_parser* p, struct tex_val m){
-	struct tex_token t, *ret = NULL;
+	p->cond_n++;
+	return NULL;
+}
 
-	while(t = tex_read_token(p), !tex_token_eq(t, ELSE) && !tex_token_eq(t, FI))
-		ret = tex_token_append(ret, t);
+//Reached at the end of a branch that was taken, the rest of the conditional is skipped
+struct tex_token *tex_handle_macro_else(struct tex_parser* p, struct tex_val m){
+	if(p->cond_n == 0)
+		p->error(p, "Extra \\else");
 
-	if(tex_token_eq(t, FI)) return ret;
+	tex_skip_conditional(p, FALSE);
+	p->cond_n--;
+	return NULL;
+}
 
-	while(t = tex_read_token(p), !tex_token_eq(t, FI));
+struct tex_token *tex_handle_macro_fi(struct tex_parser* p, struct tex_val m){
+	if(p->cond_n == 0)
+		p->error(p, "Extra \\fi");
 
-	return ret;
+	p->cond_n--;
+	return NULL;
 }
 
-void tex_define_macro_tokens(struct tex_parser *p, char *cs, struct tex_token *arglist, struct tex_token *replacement) {
+void tex_define_macro_tokens(struct tex_parser *p, unsigned cs, struct tex_token *arglist, struct tex_token *replacement) {
 	assert(p);
-	assert(p->block->vals_n < VAL_MAX);
 
-	struct tex_block *b = p->block;
+	struct tex_macro *m = tex_macro_compile(p, arglist, replacement);
+	tex_token_free(p, arglist);
+	tex_token_free(p, replacement);
+
+	struct tex_val v = {TEX_MACRO, (struct tex_token){TEX_ESC, .sym=cs}, m, tex_handle_macro_general};
+
 	if(p->in_global){
-		while(p->block->parent) p->block = p->block->parent;
+		tex_val_set_global(p, v);
 		p->in_global = FALSE;
+	} else
+		tex_val_set(p, v);
+}
+
+//Compile a parameter text and replacement list in to a macro body. Parameters of the
+//parameter text become argument slots in the replacement, any other tokens are copied
+//as they are
+struct tex_macro *tex_macro_compile(struct tex_parser *p, struct tex_token *arglist, struct tex_token *replacement) {
+	size_t tok_n = 0, op_n = 0, arg_n = 0;
+	int literal = FALSE, param_n = 0;
+
+	for(struct tex_token *t = arglist; t; t = t->next) {
+		if(t->cat == TEX_PARAMETER) param_n++;
+		arg_n++;
 	}
 
-	tex_val_set(p, (struct tex_val){TEX_MACRO, (struct tex_token){TEX_ESC, .s=cs}, arglist, replacement, tex_handle_macro_general});
+	for(struct tex_token *t = replacement; t; t = t->next) {
+		if(t->cat == TEX_PARAMETER && t->c >= 1 && t->c <= param_n) {
+			op_n++;
+			literal = FALSE;
+		} else {
+			if(!literal) op_n++;
+			literal = TRUE;
+			tok_n++;
+		}
+	}
+
+	struct tex_macro *m = malloc(sizeof *m + op_n * sizeof *m->op + arg_n * sizeof *m->fail
+		+ (tok_n + arg_n) * sizeof *m->tok);
+	if(!m) p->error(p, "Could not allocate memory");
+
+	*m = (struct tex_macro){1, param_n, .op=(struct tex_macro_op *)(m+1)};
+	m->fail = (size_t *)(m->op + op_n);
+	m->tok = (tex_packed *)(m->fail + arg_n);
+	m->arg = m->tok + tok_n;
+
+	for(struct tex_token *t = replacement; t; t = t->next) {
+		if(t->cat == TEX_PARAMETER && t->c >= 1 && t->c <= param_n) {
+			m->op[m->op_n++] = (struct tex_macro_op){TEX_OP_PARAM, .n=t->c};
+			continue;
+		}
 
-	p->block = b;
+		if(m->op_n == 0 || m->op[m->op_n-1].type != TEX_OP_TOKENS)
+			m->op[m->op_n++] = (struct tex_macro_op){TEX_OP_TOKENS, m->tok_n, 0};
+
+		m->tok[m->tok_n++] = tex_token_pack(*t);
+		m->op[m->op_n-1].n++;
+	}
+
+	for(struct tex_token *t = arglist; t; t = t->next)
+		m->arg[m->arg_n++] = tex_token_pack(*t);
+	tex_macro_delimiters(m);
+
+	return m;
+}
+
+//Fill in the failure table for the delimiters in the parameter text of m. For a token
+//at arg[i] in a delimiter starting at arg[d], fail[i] is the length of the longest
+//proper prefix of arg[d..i] that is also a suffix of it: when the token after arg[i]
+//does not match, matching goes on from there
+void tex_macro_delimiters(struct tex_macro *m) {
+	size_t d = 0;
+
+	for(size_t i = 0; i < m->arg_n; i++) {
+		m->fail[i] = 0;
+		if(tex_packed_cat(m->arg[i]) == TEX_PARAMETER) {
+			d = i + 1;
+			continue;
+		}
+		if(i == d) continue;
+
+		size_t k = m->fail[i-1];
+		while(k > 0 && m->arg[d+k] != m->arg[i])
+			k = m->fail[d+k-1];
+		if(m->arg[d+k] == m->arg[i])
+			k++;
+		m->fail[i] = k;
+	}
+}
+
+//Drop one reference to a macro body
+void tex_macro_release(struct tex_macro *m) {
+	if(m && --m->ref == 0)
+		free(m);
 }
 
-char *tex_read_control_sequence(struct tex_parser *p) {
+unsigned tex_read_control_sequence(struct tex_parser *p) {
 	assert(p);
 
 	struct tex_token tok = tex_read_char(p);
-	char *cs = NULL;
+	unsigned cs;
 
 	if(tok.cat == TEX_EOL) {
-		cs = strdup("");
-		assert(cs);
+		cs = tex_symbol_n(p, "", 0);
 		p->state = TEX_MIDLINE;
 	} else if (tok.cat != TEX_LETTER) {
-		cs = malloc(2*sizeof(char));
-		assert(cs);
-		cs[0] = tok.c;
-		cs[1] = 0;
+		char buf[4];
+		cs = tex_symbol_n(p, buf, tex_utf8_encode(tok.c, buf));
 		p->state = TEX_SKIPSPACE;
 	} else { // Must be a TEX_LETTER
-		char buf[CS_MAX+1];
+		char buf[CS_MAX+4];
 		size_t n = 0;
 
 		do {
-			assert(n < CS_MAX);
-			buf[n++] = tok.c;
+			if(n >= CS_MAX)
+				p->error(p, "Control sequence name is longer than %i bytes", CS_MAX);
+			n += tex_utf8_encode(tok.c, &buf[n]);
 		} while ((tok = tex_read_char(p)).cat == TEX_LETTER);
 
 		tex_unread_char(p);
 
-		buf[n++] = 0;
-		cs = strdup(buf);
+		cs = tex_symbol_n(p, buf, n);
 
 		p->state = TEX_SKIPSPACE;
 	}
@@ -580,19 +1108,64 @@ void tex_unread_char(struct tex_parser *p) {
 	assert(p->char_stream->type == TEX_BUF || p->char_stream->type == TEX_FILE);
 
 	if(p->char_stream->type == TEX_BUF) {
-		assert(p->char_stream->buf.i > 0);
-		p->char_stream->buf.i--;
-	} else //TEX_FILE
-		ungetc(p->char_stream->last, p->char_stream->file);
+		//Only the shortest form of a character is decoded, so it took as many bytes
+		//as its encoding
+		char buf[4];
+		size_t n = tex_utf8_encode(p->char_stream->last, buf);
+		assert(p->char_stream->buf.i >= n);
+		p->char_stream->buf.i -= n;
+	} else { //TEX_FILE
+		assert(!p->char_stream->unread);
+		p->char_stream->unread = TRUE;
+	}
 
 	//NOTE: this doesn't set the correct column or line
 }
 
-struct tex_token tex_read_char(struct tex_parser *p) {
-	assert(p);
+//Read the next character of a file stream, returns FALSE at the end of the file
+static int tex_read_file_char(struct tex_char_stream *s, uint32_t *c) {
+	if(s->ahead_n == 0) {
+		int b = fgetc(s->file);
+		if(b == EOF) return FALSE;
+		s->ahead[s->ahead_n++] = b;
+	}
+
+	size_t len = tex_utf8_len(s->ahead[0]);
+	while((size_t)s->ahead_n < len) {
+		int b = fgetc(s->file);
+		if(b == EOF) break;
+		s->ahead[s->ahead_n++] = b;
+	}
+
+	//Bytes after an invalid sequence are read again as the start of the next character
+	size_t n = tex_utf8_decode((char *)s->ahead, s->ahead_n, c);
+	s->ahead_n -= n;
+	memmove(s->ahead, s->ahead + n, s->ahead_n);
+	return TRUE;
+}
+
+//Count the character c just read from s and return it as a token
+static inline struct tex_token tex_read_char_at(struct tex_parser *p, struct tex_char_stream *s, uint32_t c, char cat) {
+	s->last = c;
+	p->char_n++;
+
+	//Update file position
+	if(c == '\n'){
+		s->line++;
+		s->col=0;
+	}else
+		s->col++;
 
+	assert(cat <= TEX_CAT_NUM);
+	return (struct tex_token){cat, .c=c};
+}
+
+//Read a character that is not ASCII in a buffer: the end of a stream, a character from
+//a file or one above ASCII. Kept apart so the common case stays small
+__attribute__((noinline))
+static struct tex_token tex_read_char_slow(struct tex_parser *p) {
 	struct tex_char_stream *s;
-	char c;
+	uint32_t c;
 
 	for(;;){
 		s = p->char_stream;
@@ -607,55 +1180,59 @@ struct tex_token tex_read_char(struct tex_parser *p) {
 		//Try to read a new character
 		if(s->type == TEX_BUF) {
 			if(s->buf.i >= s->buf.n) {
-				//TODO: free old stream
 				p->char_stream = s->next;
+				tex_char_stream_free(s);
 				continue;
 			}
 
-			c = s->buf.buf[s->buf.i++];
+			s->buf.i += tex_utf8_decode(&s->buf.buf[s->buf.i], s->buf.n - s->buf.i, &c);
 			break;
 		}
 
-		int i = fgetc(s->file);
-		if(i == EOF) {
-			//TODO: free old stream
+		if(s->unread) {
+			s->unread = FALSE;
+			c = s->last;
+			break;
+		}
+
+		if(!tex_read_file_char(s, &c)) {
 			p->char_stream = s->next;
+			tex_char_stream_free(s);
 			continue;
 		}
-
-		c = (char)i;
 		break;
 	}
 
-	s->last = c;
+	return tex_read_char_at(p, s, c, tex_catcode(p, c));
+}
 
-	//Update file position
-	if(c == '\n'){
-		s->line++;
-		s->col=0;
-	}else
-		s->col++;
+struct tex_token tex_read_char(struct tex_parser *p) {
+	assert(p);
 
-	//Read character category
-	char cat = p->block->cat[(size_t)c];
-	assert(cat <= TEX_CAT_NUM);
+	//ASCII from a buffer needs only the flat category code table
+	struct tex_char_stream *s = p->char_stream;
+	if(s && s->type == TEX_BUF && s->buf.i < s->buf.n) {
+		unsigned char c = s->buf.buf[s->buf.i];
+		if(c < 128) {
+			s->buf.i++;
+			return tex_read_char_at(p, s, c, p->cat[c]);
+		}
+	}
 
-	return (struct tex_token){cat, .c=c};
+	return tex_read_char_slow(p);
 }
 
 //Read the next token from the parser input
 struct tex_token tex_read_token(struct tex_parser *p) {
 	struct tex_token t;
 
-	//Try to read a token from the token stream
-	if(p->token) {
-		t = *p->token;
-		p->token = p->token->next;
+	//Try to read a token from the token input
+	if(tex_read_input_token(p, &t))
 		return t;
-	}
 
 	//Otherwise, try to parse at token from the character stream
 	t = tex_read_char(p);
+	p->token_n++;
 
 	assert(p->state == TEX_NEWLINE || p->state == TEX_SKIPSPACE || p->state == TEX_MIDLINE);
 
@@ -670,7 +1247,7 @@ struct tex_token tex_read_token(struct tex_parser *p) {
 
 	case TEX_EOL:
 		switch(p->state){
-		case TEX_NEWLINE:	t = (struct tex_token){TEX_ESC, .s=strdup("par")}; break; //Return \par
+		case TEX_NEWLINE:	t = (struct tex_token){TEX_ESC, .sym=p->sym_par}; break; //Return \par
 		case TEX_SKIPSPACE:	t = tex_read_token(p); break;  //Skip space
 		case TEX_MIDLINE:	t = (struct tex_token){TEX_OTHER, .c=' '}; break; // Convert to space
 		default: assert(p->state == TEX_NEWLINE || p->state == TEX_SKIPSPACE || p->state == TEX_MIDLINE);
@@ -689,13 +1266,13 @@ struct tex_token tex_read_token(struct tex_parser *p) {
 			return (struct tex_token){TEX_OTHER, .c=t.c};
 		}
 
-		if(!isdigit(t.c))
+		if(t.c < '0' || t.c > '9')
 				p->error(p, "Expected number after parameter character");
 		p->state = TEX_MIDLINE;
 		return (struct tex_token){TEX_PARAMETER, .c=t.c-'0'};
 
 	case TEX_ESC:
-		t.s = tex_read_control_sequence(p);
+		t.sym = tex_read_control_sequence(p);
 		p->state = TEX_SKIPSPACE;
 		break;
 
@@ -710,27 +1287,24 @@ struct tex_token tex_read_token(struct tex_parser *p) {
 }
 
 struct tex_token *tex_macro_replace(struct tex_parser *p, struct tex_token t) {
-	assert(t.cat = TEX_ESC);
+	assert(t.cat == TEX_ESC);
 	struct tex_val *m = tex_val_find(p, t);
-	if(!m) p->error(p, "Macro '\\%s' not found", t.s);
+	if(!m) p->error(p, "Macro '\\%s' not found", tex_symbol_name(p, t.sym));
 
 	assert(m->handler);
+	if(p->profile)
+		return tex_profile_call(p, m);
 	return m->handler(p, *m);
 }
 
+//Parameters in macro bodies are replaced as the body is read, any other parameter
+//token is an error
 struct tex_token *tex_parameter_replace(struct tex_parser *p, struct tex_token t) {
-	assert(p && p->stack);
+	assert(p);
 	assert(t.cat == TEX_PARAMETER);
 
-	//TODO: this should actually look up the hierarchy for a macro block
-
-	//ERROR: parameter found not in macro replacement
-	assert(p->stack->macro.cat == TEX_ESC);
-
-	struct tex_token *para = p->stack->parameter[(size_t)t.c-1];
-	if(para == NULL) p->error(p, "Undefined parameter %i", t.c);
-
-	return tex_token_copy(para);
+	p->error(p, "Parameter #%i used outside of macro definition", t.c);
+	return NULL;
 }
 
 #define CHAR_MAX_LEN 12
@@ -747,7 +1321,7 @@ int tex_read_num(struct tex_parser *p) {
 		s[n++] = t.c;
 	}
 
-	p->token = tex_token_prepend(t, p->token);
+	tex_input_token(p, t);
 
 	if(n == 0)
 		p->error(p, "Expected an integer value, but no numbers have been found");
@@ -762,7 +1336,7 @@ int tex_read_num(struct tex_parser *p) {
 }
 
 char *tex_read_filename(struct tex_parser *p) {
-	char filename[FILENAME_MAX+1];
+	char filename[FILENAME_MAX+4];
 	size_t n = 0;
 
 	while(n < FILENAME_MAX){
@@ -770,11 +1344,11 @@ char *tex_read_filename(struct tex_parser *p) {
 		for(;;) {
 			t = tex_read_token(p);
 			if(t.cat != TEX_ESC && t.cat != TEX_PARAMETER) break;
-			p->token = tex_token_join(tex_expand_token(p, t), p->token);
+			tex_input_list(p, tex_expand_token(p, t));
 		}
 
 		if(t.cat == TEX_INVALID || t.c == ' ') break;
-		filename[n++] = t.c;
+		n += tex_utf8_encode(t.c, &filename[n]);
 	}
 
 	filename[n] = 0;
@@ -783,6 +1357,95 @@ char *tex_read_filename(struct tex_parser *p) {
 
 }
 
+//Read the next output character in to the lookahead buffer, 0 at the end of input.
+//Returns FALSE without reading if an included file has to be written first
+static int tex_read_glyph_char(struct tex_parser *p) {
+	uint32_t c;
+
+	for(;;) {
+		if(p->include) return FALSE;
+
+		struct tex_token tok = tex_read_token(p);
+		switch(tok.cat) {
+		case TEX_ESC: //fallthrough
+		case TEX_PARAMETER: tex_input_list(p, tex_expand_token(p, tok)); continue;
+		case TEX_IGNORE: continue;
+		case TEX_BEGIN_GROUP: tex_block_enter(p); continue;
+		case TEX_END_GROUP: tex_block_exit(p); continue;
+		case TEX_INVALID: c = 0; break;
+		default: c = tok.c;
+		}
+		break;
+	}
+
+	//Characters above ASCII are written as UTF-8, the glyph map works on bytes
+	if(p->charbuf_n + 4 > p->charbuf_cap) {
+		size_t cap = p->charbuf_cap ? 2*p->charbuf_cap : 16;
+		char *buf = realloc(p->charbuf, cap);
+		if(!buf) p->error(p, "Could not allocate memory");
+		p->charbuf = buf;
+		p->charbuf_cap = cap;
+	}
+
+	p->charbuf_n += tex_utf8_encode(c, &p->charbuf[p->charbuf_n]);
+	return TRUE;
+}
+
+//Remove the first n characters of the lookahead buffer
+static void tex_read_glyph_drop(struct tex_parser *p, size_t n) {
+	assert(n <= p->charbuf_n);
+	memmove(p->charbuf, &p->charbuf[n], p->charbuf_n - n);
+	p->charbuf_n -= n;
+
+	if(p->include) {
+		assert(n <= p->include_at);
+		p->include_at -= n;
+	}
+}
+
+//Write the contents of f to the output verbatim, after the characters already read
+void tex_include(struct tex_parser *p, FILE *f) {
+	assert(f);
+	if(p->include)
+		p->error(p, "Can not include a file while another is being included");
+
+	p->include = f;
+	p->include_at = p->charbuf_n;
+}
+
+//Write n bytes at buf to the output verbatim like tex_include(), buf is freed once
+//they have been written
+void tex_include_buf(struct tex_parser *p, char *buf, size_t n) {
+	assert(buf);
+	if(p->include) {
+		free(buf);
+		p->error(p, "Can not include a file while another is being included");
+	}
+
+	if(n == 0) {
+		free(buf);
+		return;
+	}
+
+	FILE *f = fmemopen(buf, n, "r");
+	if(!f) {
+		free(buf);
+		p->error(p, "Could not allocate memory");
+	}
+
+	tex_include(p, f);
+	p->include_buf = buf;
+}
+
+//Close the included file once it has all been written
+static void tex_include_end(struct tex_parser *p) {
+	fclose(p->include);
+	free(p->include_buf);
+	p->include = NULL;
+	p->include_buf = NULL;
+}
+
+
 char tex_read_glyph(struct tex_parser *p) {
 	assert(p);
 
@@ -794,78 +1457,193 @@ char tex_read_glyph(struct tex_parser *p) {
 		return ret;
 	}
 
-	//Fill up character buffer
-	while(p->charbuf_n < CHARBUF_SIZE) {
-		struct tex_token tok = tex_read_token(p);
-		switch(tok.cat) {
-		case TEX_ESC: //fallthrough
-		case TEX_PARAMETER: {
-			struct tex_token *expansion = tex_expand_token(p, tok);
-			p->token = tex_token_join(expansion, p->token);
-			continue;
-			}
-		case TEX_IGNORE: continue;
-		case TEX_BEGIN_GROUP: tex_block_enter(p); continue;
-		case TEX_END_GROUP: tex_block_exit(p); continue;
-		case TEX_STACK_POP: tex_stack_exit(p); continue;
-		case TEX_INVALID: tok.c = 0; //fallthrough
-		default: p->charbuf[p->charbuf_n++] = tok.c;
-		}
+	//Included files are written once everything read before them has been
+	if(p->include && p->include_at == 0) {
+		int c = getc(p->include);
+		if(c != EOF) return c;
+
+		tex_include_end(p);
 	}
 
-	//Is the charbuf full of invalid tokens? If so then we are done
-	if(p->charbuf[0] == 0) return 0;
+	//Follow the map as far as the input matches, reading ahead only as needed,
+	//and remember the longest mapped sequence
+	unsigned node = 0;
+	size_t n = 0, match_n = 0;
+	char *match = NULL;
 
-	//Search for a mapping, largest to smallest
+	for(;;) {
+		if(n == p->charbuf_n && !tex_read_glyph_char(p)) break;
 
-	char buf[CHARBUF_SIZE+1];
-	memcpy(buf, p->charbuf, CHARBUF_SIZE);
+		char c = p->charbuf[n];
+		if(c == 0) break;
 
-	for(int n = CHARBUF_SIZE; n > 0; n--) {
-		buf[n] = 0;
-		for(int i = 0; i < MAP_SIZE; i++) {
-			if(strcmp(p->map[i].in, buf) == 0) {
-				p->mapout = p->map[i].out;
-				memmove(p->charbuf, &p->charbuf[n], CHARBUF_SIZE-n);
-				p->charbuf_n -= n;
-				return tex_read_glyph(p);
-			}
+		node = tex_map_next(&p->map, node, c);
+		if(!node) break;
+
+		n++;
+		if(p->map.node[node].out) {
+			match = p->map.node[node].out;
+			match_n = n;
 		}
 	}
 
+	if(match) {
+		p->mapout = match;
+		tex_read_glyph_drop(p, match_n);
+		return tex_read_glyph(p);
+	}
+
+	//Nothing is left before an included file
+	if(p->charbuf_n == 0)
+		return tex_read_glyph(p);
+
 	//No mapping, return oldest character
-	memmove(p->charbuf, &p->charbuf[1], CHARBUF_SIZE-1);
-	p->charbuf_n -= 1;
+	//An invalid character means we are done, and stays in the buffer
+	char c = p->charbuf[0];
+	if(c != 0) tex_read_glyph_drop(p, 1);
+
+	return c;
+}
+
+//Copy plain characters straight to the output buffer, skipping tex_read_glyph().
+//Returns the number of characters written, which is 0 if the next character
+//has to be read by tex_read_glyph()
+static int tex_read_plain(struct tex_parser *p, char *buf, int n) {
+	if(p->mapout || p->include) return 0;
 
-	return buf[0];
+	struct tex_scan *scan = &p->scan;
+	if(scan->dirty) tex_scan_update(p);
 
+	//Characters already read ahead can be written if they can not start a mapping
+	int i = 0;
+	while(p->charbuf_n > 0 && i < n) {
+		char c = p->charbuf[0];
+		if(c == 0 || scan->cls[(unsigned char)c] & TEX_SCAN_MAP)
+			return i;
+
+		buf[i++] = c;
+		tex_read_glyph_drop(p, 1);
+	}
+
+	struct tex_char_stream *s = p->char_stream;
+	if(p->input || !s || s->type != TEX_BUF)
+		return i;
+
+	char *in = &s->buf.buf[s->buf.i];
+	size_t run = tex_scan(p, in, s->buf.n - s->buf.i < (size_t)(n - i) ? s->buf.n - s->buf.i : (size_t)(n - i));
+	if(run == 0)
+		return i;
+
+	//Same state changes as tex_read_token() for letters, other characters and spaces.
+	//Bytes above ASCII are only in the run if none of them is special, they are copied
+	//as they are and counted once per character
+	size_t cont = 0;
+	for(size_t k = 0; k < run; k++) {
+		char c = in[k];
+		unsigned char cls = scan->cls[(unsigned char)c];
+		if(cls & TEX_SCAN_SPACE) {
+			if(p->state != TEX_MIDLINE) continue;
+			p->state = TEX_SKIPSPACE;
+			c = ' ';
+		} else {
+			p->state = TEX_MIDLINE;
+			if(cls & TEX_SCAN_CONT) cont++;
+		}
+
+		buf[i++] = c;
+	}
+
+	s->buf.i += run;
+	s->col += run - cont;
+	p->char_n += run - cont;
+	p->token_n += run - cont;
+
+	return i;
 }
 
 //Write the next n characters to the output buffer, returns the number written.
+//Fewer than n characters are only written at the end of input
 int tex_read(struct tex_parser *p, char *buf, int n) {
 	assert(n>=0);
 
-	int i;
-	for(i = 0; i < n; i++) {
-		if(p->include) {
-			if(feof(p->include)) p->include = NULL;
-			else{
-				int c = getc(p->include);
-				if(c > 0){
-					buf[i] = (char)c;
-					continue;
-				}
-			}
+	int i = 0;
+	while(i < n) {
+		//Rest of a mapped sequence
+		if(p->mapout) {
+			size_t k = strlen(p->mapout);
+			if(k > (size_t)(n-i)) k = n-i;
+
+			memcpy(&buf[i], p->mapout, k);
+			i += k;
+			p->mapout += k;
+			if(!*p->mapout) p->mapout = NULL;
+			continue;
+		}
+
+		//Included file, once everything read before it has been written
+		if(p->include && p->include_at == 0) {
+			size_t k = fread(&buf[i], 1, n-i, p->include);
+			i += k;
+			if(i < n)
+				tex_include_end(p);
+			continue;
 		}
 
-		buf[i] = tex_read_glyph(p);
-		if(buf[i] == 0) break;
+		int plain = tex_read_plain(p, &buf[i], n-i);
+		if(plain > 0) {
+			i += plain;
+			continue;
+		}
+
+		char c = tex_read_glyph(p);
+		if(c == 0) break;
+		buf[i++] = c;
 	}
 
 	return i;
 }
 
 void tex_free_parser(struct tex_parser *p){
-	//TODO: actually free the parser
+	while(p->char_stream) {
+		struct tex_char_stream *s = p->char_stream;
+		p->char_stream = s->next;
+		tex_char_stream_free(s);
+	}
+
+	if(p->include)
+		tex_include_end(p);
+	for(int i = 0; i < 16; i++)
+		if(p->in[i]) fclose(p->in[i]);
+	tex_out_free(p);
+	tex_prefetch_free(p);
+
+	while(p->input)
+		tex_frame_pop(p);
+	while(p->frame_free) {
+		struct tex_frame *f = p->frame_free;
+		p->frame_free = f->parent;
+		free(f);
+	}
+
+	while(p->level > 0)
+		tex_block_exit(p);
+	free(p->save);
+
+	for(unsigned id = 1; id < p->symtab.n; id++)
+		tex_val_free(p, p->symtab.sym[id].val);
+
+	tex_token_pool_free(p);
+	tex_symtab_free(p);
+	tex_cat_pages_free(p);
+	tex_map_free(p);
+	free(p->charbuf);
+	free(p->argbuf.tok);
+	free(p->handler);
+	tex_profile_free(p);
+	for(size_t i = 0; i < p->dep_n; i++)
+		free(p->dep[i].name);
+	free(p->dep);
+	if(p->format)
+		munmap(p->format, p->format_n);
 }
 
@@ -0,0 +1,388 @@
+/* prefetch.c
+ *
+ * Reading input files ahead of the parser. Files named by a literal
+ * \input{name} or \include{name} in the input, or listed with --prefetch, are
+ * read in to memory by a thread of the parser, so \input and \include find
+ * them there rather than waiting for the file system. Files read ahead are
+ * scanned for the files they name in turn.
+ *
+ * A file is only used if it is still the same file, of the same size and
+ * modification time, when the parser gets to it, and files opened by \openout
+ * are dropped. Anything else is read as it would be without the thread.
+ *
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tex.h"
+
+//Find the next literal \input{name} or \include{name} in the n bytes at s, returns
+//the name and sets *len to its length and *next past it, or returns NULL
+static const char *tex_prefetch_find(const char *s, size_t n, size_t *len, const char **next) {
+	const char *end = s + n;
+
+	while(s < end) {
+		const char *at = memchr(s, '\\', end - s);
+		if(!at) return NULL;
+		s = at + 1;
+
+		const char *name;
+		if(end - s >= 6 && memcmp(s, "input{", 6) == 0)
+			name = s + 6;
+		else if(end - s >= 8 && memcmp(s, "include{", 8) == 0)
+			name = s + 8;
+		else
+			continue;
+
+		//Names made by expansion, or spread over lines, are left to the parser
+		const char *close = name;
+		while(close < end && close - name < FILENAME_MAX && *close != '}' &&
+				*close != '\\' && *close != '{' && *close != '\n' && *close != ' ' &&
+				*close != '#' && *close != '%' && *close != 0)
+			close++;
+
+		if(close == end || *close != '}' || close == name)
+			continue;
+
+		*len = close - name;
+		*next = close + 1;
+		return name;
+	}
+
+	return NULL;
+}
+
+//64 bit FNV-1a of a file name
+static uint64_t tex_prefetch_hash(const char *name, size_t len) {
+	uint64_t h = 14695981039346656037ULL;
+	while(len-- > 0) {
+		h ^= (unsigned char)*name++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+//Returns the file with the given name, the lock must be held
+static struct tex_prefetch_file *tex_prefetch_lookup(struct tex_prefetch *pf, const char *name, size_t len) {
+	if(!pf->bucket) return NULL;
+
+	uint64_t h = tex_prefetch_hash(name, len);
+	for(struct tex_prefetch_file *f = pf->bucket[h & (pf->bucket_n-1)]; f; f = f->chain)
+		if(f->hash == h && strncmp(f->name, name, len) == 0 && f->name[len] == 0)
+			return f;
+	return NULL;
+}
+
+//Rebuild the bucket array with n buckets, n must be a power of two. The old buckets
+//are kept if there is no memory for new ones
+static void tex_prefetch_rehash(struct tex_prefetch *pf, size_t n) {
+	struct tex_prefetch_file **bucket = calloc(n, sizeof *bucket);
+	if(!bucket) return;
+
+	for(struct tex_prefetch_file *f = pf->head; f; f = f->next) {
+		size_t b = f->hash & (n-1);
+		f->chain = bucket[b];
+		bucket[b] = f;
+	}
+
+	free(pf->bucket);
+	pf->bucket = bucket;
+	pf->bucket_n = n;
+}
+
+//Queue a file unless it was named before, the lock must be held
+static void tex_prefetch_add(struct tex_prefetch *pf, const char *name, size_t len) {
+	if(!pf->bucket) {
+		tex_prefetch_rehash(pf, 64);
+		if(!pf->bucket) return;
+	}
+
+	if(tex_prefetch_lookup(pf, name, len))
+		return;
+
+	//Nothing is lost but the read ahead if there is no memory for it
+	struct tex_prefetch_file *f = calloc(1, sizeof *f);
+	if(!f) return;
+	f->name = strndup(name, len);
+	if(!f->name) {
+		free(f);
+		return;
+	}
+
+	if(pf->tail)
+		pf->tail->next = f;
+	else
+		pf->head = f;
+	pf->tail = f;
+	if(!pf->load)
+		pf->load = f;
+
+	f->hash = tex_prefetch_hash(name, len);
+	size_t b = f->hash & (pf->bucket_n-1);
+	f->chain = pf->bucket[b];
+	pf->bucket[b] = f;
+
+	//Keep chains short
+	if(++pf->file_n > pf->bucket_n - pf->bucket_n/4)
+		tex_prefetch_rehash(pf, 2 * pf->bucket_n);
+
+	pthread_cond_signal(&pf->work);
+}
+
+//Queue the files named in the n bytes at s
+static void tex_prefetch_add_named(struct tex_prefetch *pf, const char *s, size_t n) {
+	const char *end = s + n, *name;
+	size_t len;
+
+	while((name = tex_prefetch_find(s, end - s, &len, &s))) {
+		pthread_mutex_lock(&pf->lock);
+		tex_prefetch_add(pf, name, len);
+		pthread_mutex_unlock(&pf->lock);
+	}
+}
+
+static uint64_t tex_prefetch_mtime(struct stat *st) {
+	return (uint64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+//Read the whole of f in to memory, returns the contents or NULL if f is not a regular
+//file, changed while it was read, or would take more memory than is left for
+//read ahead. Takes the size from held if it returns contents
+static char *tex_prefetch_load(struct tex_prefetch *pf, struct tex_prefetch_file *f) {
+	int fd = open(f->name, O_RDONLY);
+	if(fd < 0) return NULL;
+
+	struct stat st;
+	if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return NULL;
+	}
+
+	size_t size = st.st_size;
+	pthread_mutex_lock(&pf->lock);
+	int room = size <= TEX_PREFETCH_MAX - pf->held;
+	if(room) pf->held += size;
+	pthread_mutex_unlock(&pf->lock);
+
+	char *buf = room ? malloc(size ? size : 1) : NULL;
+	size_t n = 0;
+	while(buf && n < size) {
+		ssize_t k = read(fd, buf + n, size - n);
+		if(k <= 0) break;
+		n += k;
+	}
+
+	struct stat after;
+	int same = buf && n == size && fstat(fd, &after) == 0 &&
+		(size_t)after.st_size == size && tex_prefetch_mtime(&after) == tex_prefetch_mtime(&st);
+	close(fd);
+
+	if(!same) {
+		free(buf);
+		if(room) {
+			pthread_mutex_lock(&pf->lock);
+			pf->held -= size;
+			pthread_mutex_unlock(&pf->lock);
+		}
+		return NULL;
+	}
+
+	f->n = size;
+	f->dev = st.st_dev;
+	f->ino = st.st_ino;
+	f->mtime = tex_prefetch_mtime(&st);
+	return buf;
+}
+
+static void *tex_prefetch_main(void *arg) {
+	struct tex_prefetch *pf = arg;
+
+	pthread_mutex_lock(&pf->lock);
+	for(;;) {
+		//Files taken or dropped before the thread got to them are passed over
+		while(pf->load && pf->load->state != TEX_PREFETCH_QUEUED)
+			pf->load = pf->load->next;
+
+		struct tex_prefetch_file *f = pf->load;
+		if(!f) {
+			if(pf->stop) break;
+			pthread_cond_wait(&pf->work, &pf->lock);
+			continue;
+		}
+		if(pf->stop) break;
+
+		f->state = TEX_PREFETCH_LOADING;
+		pthread_mutex_unlock(&pf->lock);
+
+		//Names are queued before the file is handed over, the parser may free it after
+		char *buf = tex_prefetch_load(pf, f);
+		if(buf)
+			tex_prefetch_add_named(pf, buf, f->n);
+
+		pthread_mutex_lock(&pf->lock);
+		if(buf && f->stale) {
+			free(buf);
+			pf->held -= f->n;
+			buf = NULL;
+		}
+		f->buf = buf;
+		f->state = buf ? TEX_PREFETCH_READY : TEX_PREFETCH_DONE;
+		pthread_cond_broadcast(&pf->done);
+	}
+	pthread_mutex_unlock(&pf->lock);
+
+	return NULL;
+}
+
+//Start the read ahead thread of p, returns FALSE if it cannot be started
+static int tex_prefetch_start(struct tex_parser *p) {
+	if(p->prefetch) return p->prefetch->started;
+
+	struct tex_prefetch *pf = calloc(1, sizeof *pf);
+	if(!pf) p->error(p, "Could not allocate memory");
+
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->work, NULL);
+	pthread_cond_init(&pf->done, NULL);
+	pf->started = pthread_create(&pf->thread, NULL, tex_prefetch_main, pf) == 0;
+	p->prefetch = pf;
+	return pf->started;
+}
+
+//Read the named file ahead
+void tex_prefetch(struct tex_parser *p, const char *name) {
+	if(!tex_prefetch_start(p)) return;
+
+	pthread_mutex_lock(&p->prefetch->lock);
+	tex_prefetch_add(p->prefetch, name, strlen(name));
+	pthread_mutex_unlock(&p->prefetch->lock);
+}
+
+//Read ahead the files listed in filename, one per line. Blank lines and lines
+//starting with # are skipped
+void tex_prefetch_list(struct tex_parser *p, char *filename) {
+	FILE *f = fopen(filename, "r");
+	if(!f) p->error(p, "Could not open prefetch list %s", filename);
+
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t n;
+
+	while((n = getline(&line, &line_cap, f)) >= 0) {
+		while(n > 0 && (line[n-1] == '\n' || line[n-1] == '\r'))
+			line[--n] = 0;
+		if(n == 0 || *line == '#') continue;
+
+		tex_prefetch(p, line);
+	}
+
+	free(line);
+	fclose(f);
+}
+
+//Read ahead the files named in n bytes of input at buf
+void tex_prefetch_scan(struct tex_parser *p, const char *buf, size_t n) {
+	const char *next;
+	size_t len;
+
+	//The thread is only started once there is something for it to read
+	if(!tex_prefetch_find(buf, n, &len, &next) || !tex_prefetch_start(p))
+		return;
+
+	tex_prefetch_add_named(p->prefetch, buf, n);
+}
+
+//Take the contents of the named file if it was read ahead and has not changed since,
+//waiting for it if it is being read. Returns FALSE if it was not, the caller is to
+//free the contents otherwise
+int tex_prefetch_take(struct tex_parser *p, const char *name, char **buf, size_t *n) {
+	struct tex_prefetch *pf = p->prefetch;
+	if(!pf) return FALSE;
+
+	pthread_mutex_lock(&pf->lock);
+	struct tex_prefetch_file *f = tex_prefetch_lookup(pf, name, strlen(name));
+	if(!f) {
+		pthread_mutex_unlock(&pf->lock);
+		return FALSE;
+	}
+
+	while(f->state == TEX_PREFETCH_LOADING)
+		pthread_cond_wait(&pf->done, &pf->lock);
+
+	int ready = f->state == TEX_PREFETCH_READY;
+	if(ready) {
+		*buf = f->buf;
+		*n = f->n;
+		f->buf = NULL;
+		pf->held -= f->n;
+	}
+	f->state = TEX_PREFETCH_DONE;
+	pthread_mutex_unlock(&pf->lock);
+
+	if(!ready) return FALSE;
+
+	struct stat st;
+	if(stat(name, &st) < 0 || st.st_dev != f->dev || st.st_ino != f->ino ||
+			(size_t)st.st_size != *n || tex_prefetch_mtime(&st) != f->mtime) {
+		free(*buf);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//Forget what was read ahead of the named file, as the document is about to change it
+void tex_prefetch_drop(struct tex_parser *p, const char *name) {
+	struct tex_prefetch *pf = p->prefetch;
+	if(!pf) return;
+
+	pthread_mutex_lock(&pf->lock);
+	struct tex_prefetch_file *f = tex_prefetch_lookup(pf, name, strlen(name));
+	if(f) {
+		if(f->state == TEX_PREFETCH_LOADING)
+			f->stale = TRUE;
+		else {
+			if(f->state == TEX_PREFETCH_READY) {
+				free(f->buf);
+				f->buf = NULL;
+				pf->held -= f->n;
+			}
+			f->state = TEX_PREFETCH_DONE;
+		}
+	}
+	pthread_mutex_unlock(&pf->lock);
+}
+
+//Stop the read ahead thread, once it has finished the file it is reading, and free
+//what it read
+void tex_prefetch_free(struct tex_parser *p) {
+	struct tex_prefetch *pf = p->prefetch;
+	if(!pf) return;
+
+	if(pf->started) {
+		pthread_mutex_lock(&pf->lock);
+		pf->stop = TRUE;
+		pthread_cond_signal(&pf->work);
+		pthread_mutex_unlock(&pf->lock);
+		pthread_join(pf->thread, NULL);
+	}
+
+	while(pf->head) {
+		struct tex_prefetch_file *f = pf->head;
+		pf->head = f->next;
+		free(f->buf);
+		free(f->name);
+		free(f);
+	}
+
+	pthread_mutex_destroy(&pf->lock);
+	pthread_cond_destroy(&pf->work);
+	pthread_cond_destroy(&pf->done);
+	free(pf->bucket);
+	free(pf);
+	p->prefetch = NULL;
+}
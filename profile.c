@@ -0,0 +1,245 @@
+/* profile.c
+ *
+ * Per control sequence profile of macro expansion. Every dispatch through
+ * tex_macro_replace() is timed from the call until its expansion is done: for
+ * C handlers that is when the handler returns, for macros defined in TeX it is
+ * when the macro's body has been read. Time spent in expansions started in
+ * the meantime is inclusive time of the outer control sequence but not
+ * exclusive time.
+ *
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tex.h"
+
+static uint64_t tex_profile_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void tex_profile_start(struct tex_parser *p) {
+	p->profile = calloc(1, sizeof *p->profile);
+	if(!p->profile) p->error(p, "Could not allocate memory");
+}
+
+void tex_profile_free(struct tex_parser *p) {
+	if(!p->profile) return;
+	free(p->profile->cs);
+	free(p->profile->open);
+	free(p->profile);
+	p->profile = NULL;
+}
+
+static struct tex_profile_cs *tex_profile_cs(struct tex_parser *p, unsigned sym) {
+	struct tex_profile *prof = p->profile;
+
+	if(sym >= prof->cs_n) {
+		size_t n = p->symtab.cap > sym ? p->symtab.cap : sym + 1;
+		struct tex_profile_cs *cs = realloc(prof->cs, n * sizeof *cs);
+		if(!cs) p->error(p, "Could not allocate memory");
+		memset(cs + prof->cs_n, 0, (n - prof->cs_n) * sizeof *cs);
+		prof->cs = cs;
+		prof->cs_n = n;
+	}
+
+	return &prof->cs[sym];
+}
+
+//End the timed expansion at position i of the open list
+static void tex_profile_close(struct tex_parser *p, size_t i) {
+	struct tex_profile *prof = p->profile;
+	struct tex_profile_open *e = &prof->open[i];
+	struct tex_profile_cs *cs = tex_profile_cs(p, e->sym);
+
+	uint64_t now = tex_profile_now();
+	uint64_t incl = now - e->start;
+	cs->excl += incl > e->child ? incl - e->child : 0;
+
+	//Recursive expansions count towards inclusive time once, from the first start to
+	//the last end
+	if(--cs->active == 0)
+		cs->incl += now - cs->since;
+
+	if(i > 0)
+		prof->open[i-1].child += incl;
+
+	memmove(e, e + 1, (prof->open_n - i - 1) * sizeof *e);
+	prof->open_n--;
+}
+
+//Expand m, timing it and counting what it produced
+struct tex_token *tex_profile_call(struct tex_parser *p, struct tex_val *m) {
+	struct tex_profile *prof = p->profile;
+	struct tex_val v = *m;
+	struct tex_profile_cs *cs = tex_profile_cs(p, v.cs.sym);
+
+	uint64_t start = tex_profile_now();
+	cs->calls++;
+	if(cs->active++ == 0)
+		cs->since = start;
+	if(p->input_n > cs->depth)
+		cs->depth = p->input_n;
+
+	if(prof->open_n == prof->open_cap) {
+		size_t cap = prof->open_cap ? 2*prof->open_cap : 64;
+		struct tex_profile_open *open = realloc(prof->open, cap * sizeof *open);
+		if(!open) p->error(p, "Could not allocate memory");
+		prof->open = open;
+		prof->open_cap = cap;
+	}
+
+	size_t id = prof->next_id++;
+	prof->open[prof->open_n++] = (struct tex_profile_open){v.cs.sym, id, NULL, start};
+
+	struct tex_token *ret = v.handler(p, v);
+
+	//Entries below may have been closed by the handler reading past their end
+	size_t i = prof->open_n;
+	while(i > 0 && prof->open[i-1].id != id)
+		i--;
+	assert(i > 0);
+	i--;
+
+	//A macro defined in TeX is read in place, its expansion ends with its frame
+	struct tex_frame *f = p->input;
+	cs = tex_profile_cs(p, v.cs.sym);
+	if(v.macro && f && f->type == TEX_FRAME_MACRO && f->macro == v.macro && f->op == 0 && f->i == 0) {
+		size_t tokens = 0;
+		for(size_t k = 0; k < v.macro->op_n; k++) {
+			struct tex_macro_op *op = &v.macro->op[k];
+			if(op->type == TEX_OP_TOKENS)
+				tokens += op->n;
+			else if(f->parameter[op->n-1])
+				tokens += f->parameter[op->n-1]->n;
+		}
+		cs->tokens += tokens;
+
+		for(int k = 0; k < 9; k++)
+			if(f->parameter[k]) cs->args += f->parameter[k]->n;
+
+		prof->open[i].frame = f;
+		return ret;
+	}
+
+	for(struct tex_token *t = ret; t; t = t->next)
+		cs->tokens++;
+	tex_profile_close(p, i);
+	return ret;
+}
+
+//Called when a macro frame is popped, ending the expansion that pushed it
+void tex_profile_frame(struct tex_parser *p, struct tex_frame *f) {
+	struct tex_profile *prof = p->profile;
+
+	for(size_t i = prof->open_n; i > 0; i--) {
+		if(prof->open[i-1].frame == f) {
+			tex_profile_close(p, i-1);
+			return;
+		}
+	}
+}
+
+struct tex_profile_rank {
+	uint64_t excl;
+	unsigned sym;
+};
+
+static int tex_profile_cmp(const void *a, const void *b) {
+	const struct tex_profile_rank *x = a, *y = b;
+	return x->excl < y->excl ? 1 : x->excl > y->excl ? -1 : (int)x->sym - (int)y->sym;
+}
+
+//Control sequences that were called, most exclusive time first. Returns their number
+static size_t tex_profile_sorted(struct tex_parser *p, struct tex_profile_rank **ret) {
+	struct tex_profile *prof = p->profile;
+
+	struct tex_profile_rank *r = malloc((prof->cs_n + 1) * sizeof *r);
+	if(!r) p->error(p, "Could not allocate memory");
+
+	size_t n = 0;
+	for(unsigned sym = 1; sym < prof->cs_n; sym++)
+		if(prof->cs[sym].calls) r[n++] = (struct tex_profile_rank){prof->cs[sym].excl, sym};
+
+	qsort(r, n, sizeof *r, tex_profile_cmp);
+	*ret = r;
+	return n;
+}
+
+//Write the profile as a table sorted by exclusive time
+void tex_profile_print(struct tex_parser *p, FILE *f) {
+	assert(p->profile);
+
+	fprintf(f, "characters read: %zu\n", p->char_n);
+	fprintf(f, "tokens lexed:    %zu\n", p->token_n);
+	fprintf(f, "token allocs:    %zu (%zu recycled)\n", p->pool.allocated, p->pool.recycled);
+	fprintf(f, "groups entered:  %zu\n\n", p->group_n);
+
+	fprintf(f, "%10s %12s %12s %12s %12s %6s  %s\n", "calls", "incl ms", "excl ms", "tokens", "arg tokens", "depth", "name");
+
+	struct tex_profile_rank *r;
+	size_t n = tex_profile_sorted(p, &r);
+	for(size_t i = 0; i < n; i++) {
+		struct tex_profile_cs *cs = &p->profile->cs[r[i].sym];
+		fprintf(f, "%10zu %12.3f %12.3f %12zu %12zu %6zu  \\%s\n", cs->calls, cs->incl / 1e6, cs->excl / 1e6,
+			cs->tokens, cs->args, cs->depth, tex_symbol_name(p, r[i].sym));
+	}
+
+	free(r);
+}
+
+//Write s as a JSON string, bytes that are not valid UTF-8 are written as U+FFFD
+static void tex_profile_json_str(FILE *f, char *s) {
+	size_t n = strlen(s);
+
+	fputc('"', f);
+	while(n > 0) {
+		unsigned char c = *s;
+		if(c < 0x80) {
+			if(c == '"' || c == '\\')
+				fprintf(f, "\\%c", c);
+			else if(c < 0x20)
+				fprintf(f, "\\u%04x", c);
+			else
+				fputc(c, f);
+			s++;
+			n--;
+			continue;
+		}
+
+		uint32_t cp;
+		size_t len = tex_utf8_decode(s, n, &cp);
+		if(cp >= TEX_RAW_BYTE)
+			fputs("\\ufffd", f);
+		else
+			fwrite(s, 1, len, f);
+		s += len;
+		n -= len;
+	}
+	fputc('"', f);
+}
+
+//Write the profile as JSON, with times in nanoseconds
+void tex_profile_json(struct tex_parser *p, FILE *f) {
+	assert(p->profile);
+
+	fprintf(f, "{\n\t\"characters\": %zu,\n\t\"tokens\": %zu,\n\t\"allocations\": %zu,\n\t\"recycled\": %zu,\n\t\"groups\": %zu,\n\t\"macros\": [",
+		p->char_n, p->token_n, p->pool.allocated, p->pool.recycled, p->group_n);
+
+	struct tex_profile_rank *r;
+	size_t n = tex_profile_sorted(p, &r);
+	for(size_t i = 0; i < n; i++) {
+		struct tex_profile_cs *cs = &p->profile->cs[r[i].sym];
+		fprintf(f, "%s\n\t\t{\"name\": ", i ? "," : "");
+		tex_profile_json_str(f, tex_symbol_name(p, r[i].sym));
+		fprintf(f, ", \"calls\": %zu, \"inclusive_ns\": %llu, \"exclusive_ns\": %llu, \"tokens\": %zu, \"argument_tokens\": %zu, \"max_depth\": %zu}",
+			cs->calls, (unsigned long long)cs->incl, (unsigned long long)cs->excl, cs->tokens, cs->args, cs->depth);
+	}
+	fprintf(f, "\n\t]\n}\n");
+
+	free(r);
+}
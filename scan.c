@@ -0,0 +1,138 @@
+/* scan.c
+ *
+ * Finds the end of a run of plain characters in an input buffer, that is
+ * characters that tex_read_token() would return unchanged as letters, other
+ * characters or spaces. Uses AVX2 or SSSE3 byte shuffles when available.
+ *
+ * Bytes above ASCII are plain, and UTF-8 passes through as it is, as long as no
+ * code point above ASCII has a category code and none of them starts a glyph
+ * mapping. Otherwise they all go through tex_read_token().
+ *
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "tex.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TEX_SCAN_X86
+#endif
+
+static size_t tex_scan_scalar(struct tex_scan *scan, const char *s, size_t n) {
+	size_t i = 0;
+	while(i < n && !(scan->cls[(unsigned char)s[i]] & TEX_SCAN_SPECIAL))
+		i++;
+	return i;
+}
+
+#ifdef TEX_SCAN_X86
+
+//A byte b is special if lut[b & 15] has bit (b >> 4) set, or b is not ASCII and
+//scan->high is set
+__attribute__((target("ssse3")))
+static size_t tex_scan_ssse3(struct tex_scan *scan, const char *s, size_t n) {
+	const __m128i lut = _mm_loadu_si128((const __m128i *)scan->lut);
+	const __m128i bit = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	const unsigned high = scan->high ? 0xffff : 0;
+
+	size_t i = 0;
+	for(; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i lo = _mm_and_si128(v, nibble);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+		__m128i hit = _mm_and_si128(_mm_shuffle_epi8(lut, lo), _mm_shuffle_epi8(bit, hi));
+
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(hit, _mm_setzero_si128())) ^ 0xffff;
+		mask |= _mm_movemask_epi8(v) & high;
+		if(mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + tex_scan_scalar(scan, s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t tex_scan_avx2(struct tex_scan *scan, const char *s, size_t n) {
+	const __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)scan->lut));
+	const __m256i bit = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+	                                     1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	const unsigned high = scan->high ? ~0u : 0;
+
+	size_t i = 0;
+	for(; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i lo = _mm256_and_si256(v, nibble);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+		__m256i hit = _mm256_and_si256(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(bit, hi));
+
+		unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hit, _mm256_setzero_si256()));
+		mask |= (unsigned)_mm256_movemask_epi8(v) & high;
+		if(mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + tex_scan_ssse3(scan, s + i, n - i);
+}
+
+#endif
+
+//Pick the widest scanner the CPU supports
+void tex_scan_init(struct tex_scan *scan) {
+	memset(scan, 0, sizeof *scan);
+	scan->dirty = TRUE;
+	scan->find = tex_scan_scalar;
+
+#ifdef TEX_SCAN_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		scan->find = tex_scan_avx2;
+	else if(__builtin_cpu_supports("ssse3"))
+		scan->find = tex_scan_ssse3;
+#endif
+}
+
+//Rebuild the byte classes from the current category codes and glyph map
+void tex_scan_update(struct tex_parser *p) {
+	struct tex_scan *scan = &p->scan;
+
+	scan->high = p->cat_page != NULL;
+	for(int c = 128; c < 256; c++)
+		if(p->map.root[c])
+			scan->high = TRUE;
+
+	for(int c = 0; c < 256; c++) {
+		unsigned char cls = TEX_SCAN_SPECIAL;
+		if(c < 128) {
+			switch(p->cat[c]) {
+			case TEX_SPACE: cls = TEX_SCAN_SPACE; break;
+			case TEX_LETTER: //fallthrough
+			case TEX_OTHER: cls = 0; break;
+			}
+		} else if(!scan->high)
+			cls = c < 0xc0 ? TEX_SCAN_CONT : 0;
+		scan->cls[c] = cls;
+	}
+
+	//Characters that may start a mapping have to go through tex_read_glyph()
+	for(int c = 0; c < 256; c++)
+		if(p->map.root[c])
+			scan->cls[c] |= TEX_SCAN_SPECIAL | TEX_SCAN_MAP;
+
+	memset(scan->lut, 0, sizeof scan->lut);
+	for(int c = 0; c < 128; c++)
+		if(scan->cls[c] & TEX_SCAN_SPECIAL)
+			scan->lut[c & 15] |= 1 << (c >> 4);
+
+	scan->dirty = FALSE;
+}
+
+//Returns the length of the run of plain characters at the start of s
+size_t tex_scan(struct tex_parser *p, const char *s, size_t n) {
+	if(p->scan.dirty)
+		tex_scan_update(p);
+	return p->scan.find(&p->scan, s, n);
+}
@@ -0,0 +1,146 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tex.h"
+
+#define SYMTAB_INIT 256
+
+static unsigned long tex_symbol_hash(char *name, size_t n) {
+	unsigned long h = 2166136261UL;
+	while(n-- > 0) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+//Rebuild the bucket array with n buckets, n must be a power of two
+static void tex_symtab_rehash(struct tex_parser *p, size_t n) {
+	struct tex_symtab *tab = &p->symtab;
+
+	unsigned *bucket = calloc(n, sizeof *bucket);
+	if(!bucket) p->error(p, "Could not allocate memory");
+
+	for(unsigned id = 1; id < tab->n; id++) {
+		struct tex_symbol *s = &tab->sym[id];
+		size_t b = s->hash & (n-1);
+		s->next = bucket[b];
+		bucket[b] = id;
+	}
+
+	free(tab->bucket);
+	tab->bucket = bucket;
+	tab->bucket_n = n;
+}
+
+void tex_symtab_init(struct tex_parser *p) {
+	struct tex_symtab *tab = &p->symtab;
+
+	tab->sym = malloc(SYMTAB_INIT * sizeof *tab->sym);
+	if(!tab->sym) p->error(p, "Could not allocate memory");
+	tab->cap = SYMTAB_INIT;
+
+	//Id 0 is never a valid symbol
+	tab->sym[0] = (struct tex_symbol){0};
+	tab->n = 1;
+
+	tab->bucket = NULL;
+	tex_symtab_rehash(p, SYMTAB_INIT);
+}
+
+void tex_symtab_free(struct tex_parser *p) {
+	struct tex_symtab *tab = &p->symtab;
+
+	for(unsigned id = 1; id < tab->n; id++)
+		free(tab->sym[id].name);
+	free(tab->sym);
+	free(tab->bucket);
+
+	*tab = (struct tex_symtab){0};
+}
+
+//Copy the names of another parser's symbols, ids stay the same. Values are not copied
+void tex_symtab_copy(struct tex_parser *p, struct tex_parser *from) {
+	struct tex_symtab *tab = &p->symtab, *src = &from->symtab;
+
+	tab->sym = malloc(src->cap * sizeof *tab->sym);
+	tab->bucket = malloc(src->bucket_n * sizeof *tab->bucket);
+	if(!tab->sym || !tab->bucket) p->error(p, "Could not allocate memory");
+
+	memcpy(tab->sym, src->sym, src->n * sizeof *tab->sym);
+	memcpy(tab->bucket, src->bucket, src->bucket_n * sizeof *tab->bucket);
+	tab->cap = src->cap;
+	tab->bucket_n = src->bucket_n;
+
+	//Symbols are counted as they are copied, so a failed copy can be freed
+	tab->n = 1;
+	for(unsigned id = 1; id < src->n; id++) {
+		struct tex_symbol *sym = &tab->sym[id];
+		sym->val = NULL;
+		sym->level = 0;
+		sym->name = malloc(sym->len + 1);
+		if(!sym->name) p->error(p, "Could not allocate memory");
+		memcpy(sym->name, src->sym[id].name, sym->len + 1);
+		tab->n = id + 1;
+	}
+}
+
+static unsigned tex_symbol_lookup(struct tex_symtab *tab, char *name, size_t n, unsigned long h) {
+	for(unsigned id = tab->bucket[h & (tab->bucket_n-1)]; id; id = tab->sym[id].next) {
+		struct tex_symbol *s = &tab->sym[id];
+		if(s->hash == h && s->len == n && memcmp(s->name, name, n) == 0)
+			return id;
+	}
+	return 0;
+}
+
+//Returns the symbol id for the n character name, or 0 if it has not been interned
+unsigned tex_symbol_find(struct tex_parser *p, char *name, size_t n) {
+	return tex_symbol_lookup(&p->symtab, name, n, tex_symbol_hash(name, n));
+}
+
+//Returns the symbol id for the n character name, interning it if it is new
+unsigned tex_symbol_n(struct tex_parser *p, char *name, size_t n) {
+	struct tex_symtab *tab = &p->symtab;
+	unsigned long h = tex_symbol_hash(name, n);
+
+	unsigned found = tex_symbol_lookup(tab, name, n, h);
+	if(found) return found;
+
+	//Ids have to fit in a packed token
+	if(tab->n > TEX_PACK_SYM_MAX)
+		p->error(p, "Too many control sequences");
+
+	if(tab->n == tab->cap) {
+		struct tex_symbol *sym = realloc(tab->sym, 2 * tab->cap * sizeof *sym);
+		if(!sym) p->error(p, "Could not allocate memory");
+		tab->sym = sym;
+		tab->cap *= 2;
+	}
+
+	char *s = malloc(n+1);
+	if(!s) p->error(p, "Could not allocate memory");
+	memcpy(s, name, n);
+	s[n] = 0;
+
+	unsigned id = tab->n++;
+	size_t b = h & (tab->bucket_n-1);
+	tab->sym[id] = (struct tex_symbol){s, n, h, tab->bucket[b]};
+	tab->bucket[b] = id;
+
+	//Keep chains short
+	if(tab->n > tab->bucket_n - tab->bucket_n/4)
+		tex_symtab_rehash(p, 2 * tab->bucket_n);
+
+	return id;
+}
+
+unsigned tex_symbol(struct tex_parser *p, char *name) {
+	return tex_symbol_n(p, name, strlen(name));
+}
+
+char *tex_symbol_name(struct tex_parser *p, unsigned id) {
+	assert(id > 0 && id < p->symtab.n);
+	return p->symtab.sym[id].name;
+}
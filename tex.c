@@ -5,9 +5,16 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "tex.h"
 
@@ -38,15 +45,39 @@ static struct tex_token *handle_openout(struct tex_parser* p, struct tex_val m){
 
 	struct tex_token t = tex_read_token(p);
 	if(t.c != '=')
-		p->error(p, "\\openout expects = after file number, got %s", tex_tokenlist_as_str(&t));
+		p->error(p, "\\openout expects = after file number, got %s", tex_tokenlist_as_str(p, &t));
 
 	char *filename = tex_read_filename(p);
 
-	if(p->out[n]) fclose(p->out[n]);
-	p->out[n] = fopen(filename, "w");
-	if(p->out[n] == NULL)
+	if(!tex_out_open(p, n, filename))
 		p->error(p, "could not open \"%s\" for writing", filename);
 
+	tex_dep_add(p, filename, TRUE);
+	free(filename);
+	return NULL;
+}
+
+//Sets the category code of a character code in the current group, codes are
+//numbered as in TeX
+//\catcode<num>=<num>
+static struct tex_token *handle_catcode(struct tex_parser* p, struct tex_val m){
+	int c = tex_read_num(p);
+
+	struct tex_token t = tex_read_token(p);
+	if(t.c != '=')
+		p->error(p, "\\catcode expects = after character code, got %s", tex_tokenlist_as_str(p, &t));
+
+	int cat = tex_read_num(p);
+	if(cat < 0 || cat >= TEX_CAT_NUM)
+		p->error(p, "category code must be between 0-15");
+
+	//TEX_ESC and TEX_OTHER are switched internally
+	if(cat == 0)
+		cat = TEX_ESC;
+	else if(cat == 12)
+		cat = TEX_OTHER;
+
+	tex_catcode_set(p, c, cat);
 	return NULL;
 }
 
@@ -59,7 +90,7 @@ static struct tex_token *handle_openin(struct tex_parser* p, struct tex_val m){
 
 	struct tex_token t = tex_read_token(p);
 	if(t.c != '=')
-		p->error(p, "\\openin expects = after file number, got %s", tex_tokenlist_as_str(&t));
+		p->error(p, "\\openin expects = after file number, got %s", tex_tokenlist_as_str(p, &t));
 
 	char *filename = tex_read_filename(p);
 
@@ -68,6 +99,8 @@ static struct tex_token *handle_openin(struct tex_parser* p, struct tex_val m){
 	if(p->in[n] == NULL)
 		p->error(p, "could not open \"%s\" for reading", filename);
 
+	tex_dep_add(p, filename, FALSE);
+	free(filename);
 	return NULL;
 }
 
@@ -86,12 +119,20 @@ static struct tex_token *handle_write(struct tex_parser* p, struct tex_val m){
 	if(!block)
 		p->error(p, "expected block after \\write");
 
-	char *out = tex_tokenlist_as_str(block);
-	size_t outlen = strlen(out);
+	//The text goes to the stream's buffer, the file is written behind
+	tex_out_tokens(p, n, block);
+	tex_token_free(p, block);
+	return NULL;
+}
 
-	if(fwrite(out, 1, outlen, p->out[n]) < outlen)
-		p->error(p, "could not finish writing to file stream %i", n);
+//Closes the given output stream (0-15) once everything written to it is in the file
+//\closeout<num>
+static struct tex_token *handle_closeout(struct tex_parser* p, struct tex_val m){
+	int n = tex_read_num(p);
+	if(n < 0 || n > 15)
+		p->error(p, "output stream must be between 0-15");
 
+	tex_out_close(p, n);
 	return NULL;
 }
 
@@ -110,7 +151,7 @@ static struct tex_token *handle_read(struct tex_parser* p, struct tex_val m){
 	if(!block)
 		p->error(p, "expected block after \\read");
 
-	char *in = tex_tokenlist_as_str(block);
+	char *in = tex_tokenlist_as_str(p, block);
 	size_t inlen = strlen(in);
 
 	if(fread(in, 1, inlen, p->in[n]) < inlen)
@@ -124,9 +165,8 @@ static struct tex_token *handle_ifdefined(struct tex_parser* p, struct tex_val m
 	struct tex_token c = tex_read_token(p);
 	if(c.cat != TEX_ESC) p->error(p, "Expected macro after \\ifdefined");
 
-	struct tex_val *v = tex_val_find(p, c);
-	if(v) return tex_token_alloc((struct tex_token){TEX_ESC, .s="iftrue"});
-	return tex_token_alloc((struct tex_token){TEX_ESC, .s="iffalse"});
+	if(tex_val_find(p, c)) return tex_handle_macro_iftrue(p, m);
+	return tex_handle_macro_iffalse(p, m);
 }
 
 static struct tex_token *handle_ifeof(struct tex_parser* p, struct tex_val m){
@@ -138,8 +178,8 @@ static struct tex_token *handle_ifeof(struct tex_parser* p, struct tex_val m){
 		//NOTE: in TeX, this case would just be stdin by default
 		p->error(p, "input stream %i is not open", n);
 
-	if(feof(p->in[n])) return tex_token_alloc((struct tex_token){TEX_ESC, .s="iftrue"});
-	return tex_token_alloc((struct tex_token){TEX_ESC, .s="iffalse"});
+	if(feof(p->in[n])) return tex_handle_macro_iftrue(p, m);
+	return tex_handle_macro_iffalse(p, m);
 }
 
 static struct tex_token *handle_filename(struct tex_parser* p, struct tex_val m){
@@ -148,7 +188,7 @@ static struct tex_token *handle_filename(struct tex_parser* p, struct tex_val m)
 	struct tex_char_stream *s = p->char_stream;
 	if(!s || !s->name) return NULL;
 
-	return tex_str_as_tokenlist(s->name);
+	return tex_str_as_tokenlist(p, s->name);
 }
 
 static struct tex_token *handle_catname(struct tex_parser* p, struct tex_val m){
@@ -169,13 +209,39 @@ static struct tex_token *handle_catname(struct tex_parser* p, struct tex_val m){
 	char temp = *e;
 	*e = 0;
 
-	struct tex_token *ret = tex_str_as_tokenlist(n);
+	struct tex_token *ret = tex_str_as_tokenlist(p, n);
 
 	*e = temp;
 
 	return ret;
 }
 
+//Adds a glyph mapping, output characters matching the first block are written as the
+//second instead. Mappings are global and replace any earlier one of the same sequence
+//\mapglyph{<in>}{<out>}
+static struct tex_token *handle_mapglyph(struct tex_parser* p, struct tex_val m){
+	assert(p);
+
+	struct tex_token *block = tex_read_block(p);
+	char *in = tex_tokenlist_as_str(p, block);
+	tex_token_free(p, block);
+
+	block = tex_read_block(p);
+	char *out = tex_tokenlist_as_str(p, block);
+	tex_token_free(p, block);
+
+	if(!*in) {
+		free(in);
+		free(out);
+		p->error(p, "expected characters to map after \\mapglyph");
+	}
+
+	tex_map_add(p, in, out);
+	free(in);
+	free(out);
+	return NULL;
+}
+
 static struct tex_token *handle_uppercase(struct tex_parser* p, struct tex_val m){
 	assert(p);
 
@@ -183,9 +249,10 @@ static struct tex_token *handle_uppercase(struct tex_parser* p, struct tex_val m
 	if(!block)
 		p->error(p, "expected block after \\uppercase");
 
+	//Control sequences keep their name, their c is the symbol id
 	struct tex_token *ret = block;
 	while(block){
-		if(block->c >= 'a' && block->c <= 'z')
+		if(block->cat != TEX_ESC && block->c >= 'a' && block->c <= 'z')
 			block->c -= 'a' - 'A';
 		block = block->next;
 	}
@@ -202,7 +269,7 @@ static struct tex_token *handle_lowercase(struct tex_parser* p, struct tex_val m
 
 	struct tex_token *ret = block;
 	while(block){
-		if(block->c >= 'A' && block->c <= 'Z')
+		if(block->cat != TEX_ESC && block->c >= 'A' && block->c <= 'Z')
 			block->c -= 'A' - 'a';
 		block = block->next;
 	}
@@ -213,36 +280,52 @@ static struct tex_token *handle_lowercase(struct tex_parser* p, struct tex_val m
 static struct tex_token *handle_expandafter(struct tex_parser* p, struct tex_val m){
 	assert(p);
 
-	struct tex_token first, second, *expansion;
+	struct tex_token first, second;
 
 	//Read first token
 	first = tex_read_token(p);
 
-	//Expand second token
+	//Expand second token, expansions may also be put directly in to the input
 	second = tex_read_token(p);
-	expansion = tex_expand_token(p, second);
-	if(!expansion) expansion = tex_token_alloc(second);
+	if(second.cat == TEX_ESC)
+		tex_input_list(p, tex_expand_token(p, second));
+	else
+		tex_input_token(p, second);
 
-	//Prepend first token and second expansion to token stream
-	return tex_token_prepend(first, expansion);
+	//Prepend first token to the input ahead of the expansion
+	tex_input_token(p, first);
+	return NULL;
 }
 
 static struct tex_token *handle_newline(struct tex_parser* p, struct tex_val m){
-	return tex_token_alloc((struct tex_token){TEX_OTHER, .c='\n'});
+	return tex_token_alloc(p, (struct tex_token){TEX_OTHER, .c='\n'});
 }
 
 //\include{filename}, writes the source file directly to the output
 static struct tex_token *handle_include(struct tex_parser* p, struct tex_val m){
-	char *filename = tex_tokenlist_as_str(tex_read_block(p));
+	struct tex_token *block = tex_read_block(p);
+	char *filename = tex_tokenlist_as_str(p, block);
 	if(!filename)
 		p->error(p, "expected filename after \\include");
+	tex_token_free(p, block);
+
+	char *buf;
+	size_t n;
+	if(tex_prefetch_take(p, filename, &buf, &n)) {
+		tex_dep_add(p, filename, FALSE);
+		free(filename);
+		tex_include_buf(p, buf, n);
+		return NULL;
+	}
 
 	FILE *f = fopen(filename, "r");
 	if(!f)
 		p->error(p, "could not open file %s for reading", filename);
 
-	p->include = f;
-	return tex_token_alloc((struct tex_token){TEX_OTHER, .c=getc(f)});
+	tex_dep_add(p, filename, FALSE);
+	free(filename);
+	tex_include(p, f);
+	return NULL;
 }
 
 void init_macros(struct tex_parser *p) {
@@ -258,16 +341,21 @@ void init_macros(struct tex_parser *p) {
 	tex_define_macro_func(p, "#", tex_handle_macro_hash);
 	tex_define_macro_func(p, "&", tex_handle_macro_amp);
 	tex_define_macro_func(p, " ", tex_handle_macro_space);
-	tex_define_macro_func(p, "iffalse", tex_handle_macro_iffalse);
-	tex_define_macro_func(p, "iftrue", tex_handle_macro_iftrue);
+	tex_define_conditional(p, "iffalse", tex_handle_macro_iffalse);
+	tex_define_conditional(p, "iftrue", tex_handle_macro_iftrue);
+	tex_define_macro_func(p, "else", tex_handle_macro_else);
+	tex_define_macro_func(p, "fi", tex_handle_macro_fi);
 	tex_define_macro_func(p, "openout", handle_openout);
 	tex_define_macro_func(p, "openin", handle_openin);
 	tex_define_macro_func(p, "write", handle_write);
+	tex_define_macro_func(p, "closeout", handle_closeout);
+	tex_define_macro_func(p, "catcode", handle_catcode);
 	//tex_define_macro_func(p, "read", handle_read);
-	tex_define_macro_func(p, "ifdefined", handle_ifdefined);
-	tex_define_macro_func(p, "ifeof", handle_ifeof);
+	tex_define_conditional(p, "ifdefined", handle_ifdefined);
+	tex_define_conditional(p, "ifeof", handle_ifeof);
 	tex_define_macro_func(p, "filename", handle_filename);
 	tex_define_macro_func(p, "catname", handle_catname);
+	tex_define_macro_func(p, "mapglyph", handle_mapglyph);
 	tex_define_macro_func(p, "uppercase", handle_uppercase);
 	tex_define_macro_func(p, "lowercase", handle_lowercase);
 	tex_define_macro_func(p, "expandafter", handle_expandafter);
@@ -275,6 +363,383 @@ void init_macros(struct tex_parser *p) {
 	tex_define_macro_func(p, "include", handle_include);
 }
 
+#define BUF_SIZE 65536
+
+//Write all output of p to out, buf must hold BUF_SIZE characters
+static void render(struct tex_parser *p, FILE *out, char *buf) {
+	size_t n;
+	do {
+		n =  tex_read(p, buf, BUF_SIZE);
+		fwrite(buf, sizeof(char), n, out);
+	}while(n == BUF_SIZE);
+}
+
+//Document in a batch, rendered from in to out
+struct batch_job {
+	char *in, *out;
+	int skip;			//Output is up to date and is not rendered
+	int ok;				//Rendered without errors
+	struct tex_depdb_doc dep;	//Files the document used, if the batch tracks them
+};
+
+struct batch {
+	struct batch_job *job;
+	size_t job_n;
+	size_t next;		//Next job to take, shared by the workers
+	char *format;		//Format every document starts from, or NULL
+	char *prefetch;		//List of files every document reads ahead, or NULL
+	int track;		//Record the files each document used
+	int failed;
+};
+
+//Render one document with a parser of its own, errors only end this document
+static int batch_render(struct batch *b, struct batch_job *job, char *buf) {
+	struct tex_parser *p = malloc(sizeof *p);
+	FILE *volatile out = NULL;
+	jmp_buf recover;
+
+	if(!p) return FALSE;
+	tex_init_parser(p);
+	p->recover = &recover;
+
+	if(setjmp(recover)) {
+		fprintf(stderr, "ERR:Could not render %s\n", job->in);
+		if(out) fclose(out);
+		tex_free_parser(p);
+		free(p);
+		return FALSE;
+	}
+
+	init_macros(p);
+	if(b->format) tex_format_load(p, b->format);
+	if(b->prefetch) tex_prefetch_list(p, b->prefetch);
+	tex_input(p, job->in);
+
+	out = fopen(job->out, "w");
+	if(!out) p->error(p, "Could not open %s for writing", job->out);
+
+	render(p, out, buf);
+
+	FILE *f = out;
+	out = NULL;
+	if(ferror(f) | fclose(f))
+		p->error(p, "Could not write %s", job->out);
+
+	//Files written with \openout are complete once closed, and can be hashed
+	tex_out_close_all(p);
+
+	//A document without a record is rendered again next time
+	if(b->track) {
+		if(b->format) tex_dep_add(p, b->format, FALSE);
+		tex_dep_add(p, job->out, TRUE);
+		tex_depdb_record(&job->dep, job->in, job->out, b->format, p->dep, p->dep_n);
+	}
+
+	tex_free_parser(p);
+	free(p);
+	return TRUE;
+}
+
+static void *batch_worker(void *arg) {
+	struct batch *b = arg;
+
+	char *buf = malloc(BUF_SIZE);
+	if(!buf) {
+		__atomic_store_n(&b->failed, TRUE, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	for(;;) {
+		size_t i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+		if(i >= b->job_n) break;
+		if(b->job[i].skip) continue;
+
+		b->job[i].ok = batch_render(b, &b->job[i], buf);
+		if(!b->job[i].ok)
+			__atomic_store_n(&b->failed, TRUE, __ATOMIC_RELAXED);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+//Read the "input output" pairs listed in manifest, blank lines and lines starting
+//with # are skipped
+static int batch_read(struct batch *b, char *manifest) {
+	FILE *f = fopen(manifest, "r");
+	if(!f) {
+		fprintf(stderr, "ERR:Could not open manifest %s\n", manifest);
+		return FALSE;
+	}
+
+	size_t cap = 0;
+	char *line = NULL;
+	size_t line_cap = 0;
+	int line_n = 0, ok = TRUE;
+
+	while(getline(&line, &line_cap, f) >= 0) {
+		line_n++;
+
+		char *save, *in = strtok_r(line, " \t\r\n", &save);
+		if(!in || *in == '#') continue;
+
+		char *out = strtok_r(NULL, " \t\r\n", &save);
+		if(!out || strtok_r(NULL, " \t\r\n", &save)) {
+			fprintf(stderr, "ERR:file \"%s\" line %i:expected an input and an output file\n", manifest, line_n);
+			ok = FALSE;
+			break;
+		}
+
+		if(b->job_n == cap) {
+			cap = cap ? 2*cap : 64;
+			struct batch_job *job = realloc(b->job, cap * sizeof *job);
+			if(!job) {
+				ok = FALSE;
+				break;
+			}
+			b->job = job;
+		}
+
+		struct batch_job *job = &b->job[b->job_n];
+		*job = (struct batch_job){strdup(in), strdup(out)};
+		b->job_n++;
+		if(!job->in || !job->out) {
+			ok = FALSE;
+			break;
+		}
+	}
+
+	free(line);
+	fclose(f);
+	return ok;
+}
+
+//Render the jobs that are not skipped on jobs threads
+static void batch_run(struct batch *b, int jobs) {
+	if(jobs < 1) jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if(jobs < 1) jobs = 1;
+	if((size_t)jobs > b->job_n) jobs = b->job_n ? b->job_n : 1;
+
+	pthread_t *thread = malloc(jobs * sizeof *thread);
+	int started = 0;
+	if(thread) {
+		while(started < jobs && pthread_create(&thread[started], NULL, batch_worker, b) == 0)
+			started++;
+	}
+
+	//Work on this thread if no workers could be started
+	if(started == 0)
+		batch_worker(b);
+	for(int i = 0; i < started; i++)
+		pthread_join(thread[i], NULL);
+	free(thread);
+}
+
+static void batch_free(struct batch *b) {
+	for(size_t i = 0; i < b->job_n; i++) {
+		free(b->job[i].in);
+		free(b->job[i].out);
+		free(b->job[i].dep.out);
+		free(b->job[i].dep.format);
+		for(size_t j = 0; j < b->job[i].dep.file_n; j++)
+			free(b->job[i].dep.file[j].name);
+		free(b->job[i].dep.file);
+	}
+	free(b->job);
+}
+
+//Render every document listed in manifest. Returns FALSE if any document failed
+static int batch(char *manifest, char *format, char *prefetch, int jobs) {
+	struct batch b = {.format=format, .prefetch=prefetch};
+
+	int ok = batch_read(&b, manifest);
+	if(ok) {
+		batch_run(&b, jobs);
+		ok = !b.failed;
+	}
+
+	batch_free(&b);
+	return ok;
+}
+
+//Render the documents listed in manifest whose inputs or outputs changed since the
+//last run, according to the dependency database in deps
+static int make(char *manifest, char *format, char *prefetch, int jobs, char *deps) {
+	struct batch b = {.format=format, .prefetch=prefetch, .track=TRUE};
+	struct tex_depdb db;
+
+	if(!tex_depdb_load(&db, deps)) {
+		fprintf(stderr, "ERR:dependency database %s is damaged, rendering everything\n", deps);
+		tex_depdb_free(&db);
+	}
+
+	int ok = batch_read(&b, manifest);
+	if(ok) {
+		size_t stale = 0;
+		for(size_t i = 0; i < b.job_n; i++) {
+			struct tex_depdb_doc *doc = tex_depdb_find(&db, b.job[i].out);
+			b.job[i].skip = doc && tex_depdb_fresh(doc, b.job[i].in, format);
+			if(!b.job[i].skip) stale++;
+		}
+
+		if(stale)
+			batch_run(&b, jobs);
+		ok = !b.failed;
+
+		for(size_t i = 0; i < b.job_n; i++) {
+			struct batch_job *job = &b.job[i];
+			if(job->skip) continue;
+
+			if(job->ok && job->dep.out) {
+				tex_depdb_set(&db, job->dep);
+				job->dep = (struct tex_depdb_doc){0};
+			} else
+				tex_depdb_remove(&db, job->out);
+		}
+
+		if(!tex_depdb_save(&db, deps)) {
+			fprintf(stderr, "ERR:Could not write dependency database %s\n", deps);
+			ok = FALSE;
+		}
+
+		fprintf(stderr, "%zu rendered, %zu up to date\n", stale, b.job_n - stale);
+	}
+
+	tex_depdb_free(&db);
+	batch_free(&b);
+	return ok;
+}
+
+//Render job in server mode, the parser comes first so error handlers can find the job
+struct serve_job {
+	struct tex_parser p;
+	char msg[BUFSIZE];	//Why the job failed
+	jmp_buf recover;
+};
+
+//Error handler for server jobs, keeps the message for the client and fails the job
+static void serve_error(struct tex_parser *p, char *fmt, ...) {
+	struct serve_job *job = p->error_ctx;
+	size_t n = 0;
+
+	if(p->char_stream)
+		n = snprintf(job->msg, sizeof job->msg, "line %i col %i:", p->char_stream->line+1, p->char_stream->col+1);
+
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(job->msg + n, sizeof job->msg - n, fmt, ap);
+	va_end(ap);
+
+	//The message is sent as one line
+	for(char *c = job->msg; *c; c++)
+		if(*c == '\n') *c = ' ';
+
+	longjmp(job->recover, 1);
+}
+
+//Serve render jobs read from in until it ends, writing the results to out.
+//A request is a line with the length of the document followed by the document.
+//The reply is any number of "data <length>" lines each followed by that much
+//output, then "done" or "error <message>". Returns FALSE on a malformed request
+static int serve_stream(struct tex_parser *template, FILE *in, FILE *out) {
+	static char buf[BUF_SIZE];
+	char line[64];
+
+	while(fgets(line, sizeof line, in)) {
+		char *end;
+		size_t len = strtoul(line, &end, 10);
+		if(end == line || *end != '\n') {
+			fprintf(out, "error malformed request\n");
+			fflush(out);
+			return FALSE;
+		}
+
+		char *doc = malloc(len + 1);
+		struct serve_job *job = malloc(sizeof *job);
+		if(!doc || !job || fread(doc, 1, len, in) != len) {
+			fprintf(out, "error could not read request\n");
+			fflush(out);
+			free(doc);
+			free(job);
+			return FALSE;
+		}
+
+		//Errors while copying the template only end this job too
+		job->p.error = serve_error;
+		job->p.recover = &job->recover;
+		job->p.error_ctx = job;
+
+		if(setjmp(job->recover)) {
+			fprintf(out, "error %s\n", job->msg);
+		} else {
+			tex_clone_parser(&job->p, template);
+			tex_input_borrow(&job->p, "<request>", doc, len, NULL, NULL);
+
+			size_t n;
+			do {
+				n = tex_read(&job->p, buf, BUF_SIZE);
+				if(n) {
+					fprintf(out, "data %zu\n", n);
+					fwrite(buf, 1, n, out);
+				}
+			} while(n == BUF_SIZE);
+
+			tex_out_close_all(&job->p);
+			fprintf(out, "done\n");
+		}
+		fflush(out);
+
+		tex_free_parser(&job->p);
+		free(job);
+		free(doc);
+
+		if(ferror(out))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+//Serve render jobs against template on stdin, or on a Unix socket at path
+static int serve(struct tex_parser *template, char *path) {
+	signal(SIGPIPE, SIG_IGN);
+
+	if(strcmp(path, "-") == 0)
+		return serve_stream(template, stdin, stdout);
+
+	struct sockaddr_un addr = {AF_UNIX};
+	if(strlen(path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "ERR:socket path %s is too long\n", path);
+		return FALSE;
+	}
+	strcpy(addr.sun_path, path);
+
+	//Replace a socket left behind by an earlier server, but nothing else
+	struct stat st;
+	if(stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	int s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(s < 0 || bind(s, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(s, 16) < 0) {
+		perror("ERR:could not listen on socket");
+		return FALSE;
+	}
+
+	for(;;) {
+		int c = accept(s, NULL, NULL);
+		if(c < 0) continue;
+
+		FILE *in = fdopen(c, "r");
+		FILE *out = in ? fdopen(dup(c), "w") : NULL;
+		if(in && out)
+			serve_stream(template, in, out);
+
+		if(out) fclose(out);
+		if(in) fclose(in);
+		else close(c);
+	}
+}
+
 int main(int argc, const char *argv[]) {
 	signal(SIGSEGV, handler);   // install our handler
 	signal(SIGINT, handler);   // install our handler
@@ -283,13 +748,66 @@ int main(int argc, const char *argv[]) {
 	tex_init_parser(&p);
 	init_macros(&p);
 
+	int stats = FALSE, jobs = 0;
+	char *dump = NULL, *format = NULL, *manifest = NULL, *server = NULL, *deps = NULL, *profile = NULL;
+	char *prefetch = NULL;
+	int make_mode = FALSE;
+
 	for(int i = 1; i < argc; i++) {
-		if(strcmp(argv[i], "-") == 0)
+		if(strcmp(argv[i], "--stats") == 0)
+			stats = TRUE;
+		else if(strcmp(argv[i], "--format") == 0 && i+1 < argc) {
+			format = (char *)argv[++i];
+			tex_format_load(&p, format);
+		}
+		else if(strcmp(argv[i], "--batch") == 0 && i+1 < argc)
+			manifest = (char *)argv[++i];
+		else if(strcmp(argv[i], "--make") == 0 && i+1 < argc) {
+			manifest = (char *)argv[++i];
+			make_mode = TRUE;
+		}
+		else if(strcmp(argv[i], "--profile") == 0 && i+1 < argc) {
+			profile = (char *)argv[++i];
+			tex_profile_start(&p);
+		}
+		else if(strcmp(argv[i], "--prefetch") == 0 && i+1 < argc)
+			prefetch = (char *)argv[++i];
+		else if(strcmp(argv[i], "--deps") == 0 && i+1 < argc)
+			deps = (char *)argv[++i];
+		else if(strcmp(argv[i], "--serve") == 0 && i+1 < argc)
+			server = (char *)argv[++i];
+		else if(strcmp(argv[i], "-j") == 0 && i+1 < argc)
+			jobs = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--dump") == 0 && i+1 < argc)
+			dump = (char *)argv[++i];
+		else if(strcmp(argv[i], "-") == 0)
 			tex_input_file(&p, "<stdin>", stdin);
 		else
 			tex_input(&p, (char *)argv[i]);
 	}
 
+	//Documents in a batch each get a parser of their own
+	if(manifest && make_mode) {
+		tex_free_parser(&p);
+
+		//The database sits next to the manifest by default
+		char deps_default[FILENAME_MAX];
+		if(!deps) {
+			snprintf(deps_default, sizeof deps_default, "%s.deps", manifest);
+			deps = deps_default;
+		}
+		return make(manifest, format, prefetch, jobs, deps) ? 0 : 1;
+	}
+
+	if(manifest) {
+		tex_free_parser(&p);
+		return batch(manifest, format, prefetch, jobs) ? 0 : 1;
+	}
+
+	//A batch passes the list on to the parser of each document instead
+	if(prefetch)
+		tex_prefetch_list(&p, prefetch);
+
 	//NOTE: TEX_INVALID characters do continue with a warning, as in regular tex,
 	//but instead indicated end of input. By default only '\0' and '\127' are INVALID,
 	//and this is by design to accomidate C strings gracefully
@@ -297,14 +815,38 @@ int main(int argc, const char *argv[]) {
 	//QUESTION: is it better to remove '\0' delimiter for input, to allow partial reads, or
 	//just read all the input files in at once?
 
-#define BUF_SIZE 1024
-	char buf[BUF_SIZE];
+	static char buf[BUF_SIZE];
 
-	size_t n;
-	do {
-		n =  tex_read(&p, buf, BUF_SIZE);
-		fwrite(&buf, sizeof(char), n, stdout);
-	}while(n == BUF_SIZE);
+	//The inputs of a server are its preamble, every job starts from the state they leave
+	if(server) {
+		size_t n;
+		do n = tex_read(&p, buf, BUF_SIZE); while(n == BUF_SIZE);
+
+		int ok = serve(&p, server);
+		tex_free_parser(&p);
+		return ok ? 0 : 1;
+	}
+
+	render(&p, stdout, buf);
+	tex_out_close_all(&p);
+
+	if(dump)
+		tex_format_dump(&p, dump);
+
+	if(stats) {
+		fprintf(stderr, "tokens: %zu live, %zu recycled\n", p.pool.live, p.pool.recycled);
+		fprintf(stderr, "read: %zu characters, %zu tokens\n", p.char_n, p.token_n + p.input_token_n);
+	}
+
+	//The table goes to stderr, the JSON to the named file
+	if(profile) {
+		tex_profile_print(&p, stderr);
+
+		FILE *f = fopen(profile, "w");
+		if(!f) p.error(&p, "Could not open %s for writing", profile);
+		tex_profile_json(&p, f);
+		fclose(f);
+	}
 
 	tex_free_parser(&p);
 
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -13,7 +16,6 @@
 struct tex_parser;
 
 enum tex_category {
-	TEX_STACK_POP = -2,
 	TEX_ERROR = -1,
 	TEX_OTHER = 0,
 	TEX_BEGIN_GROUP,
@@ -41,18 +43,99 @@ enum tex_state {
 	TEX_SKIPSPACE
 };
 
-#define VAL_MAX 128
-
 struct tex_token {
 	enum tex_category cat;
 	union {
-		char c;
-		char *s;
+		uint32_t c;	//Code point, see tex_utf8_decode()
+		unsigned sym;	//TEX_ESC only: interned control sequence id
 	};
 
 	struct tex_token *next, *prev;
 };
 
+//Token list with a tail pointer, so appending does not walk the list
+struct tex_token_list {
+	struct tex_token *head, *tail;
+};
+
+//Token packed in to 32 bits, the category in the low bits and the character or symbol
+//id above them. Token arrays, such as macro bodies and arguments, are stored this way
+typedef uint32_t tex_packed;
+
+#define TEX_PACK_CAT_BITS 5
+#define TEX_PACK_SYM_MAX ((1u << (32 - TEX_PACK_CAT_BITS)) - 1)
+
+static inline tex_packed tex_token_pack(struct tex_token t) {
+	uint32_t v = t.cat == TEX_ESC ? t.sym : t.c;
+	return (uint32_t)t.cat | v << TEX_PACK_CAT_BITS;
+}
+
+static inline struct tex_token tex_token_unpack(tex_packed t) {
+	struct tex_token ret = {t & ((1 << TEX_PACK_CAT_BITS) - 1)};
+	if(ret.cat == TEX_ESC)
+		ret.sym = t >> TEX_PACK_CAT_BITS;
+	else
+		ret.c = t >> TEX_PACK_CAT_BITS;
+	return ret;
+}
+
+static inline enum tex_category tex_packed_cat(tex_packed t) {
+	return t & ((1 << TEX_PACK_CAT_BITS) - 1);
+}
+
+size_t tex_utf8_encode_wide(uint32_t c, char *out);
+
+//Write the character c as UTF-8 to out, which must have room for 4 bytes. Returns the
+//number of bytes written
+static inline size_t tex_utf8_encode(uint32_t c, char *out) {
+	if(c < 128) {
+		*out = c;
+		return 1;
+	}
+	return tex_utf8_encode_wide(c, out);
+}
+
+//Growable array of packed tokens
+struct tex_tokvec {
+	tex_packed *tok;
+	size_t n, cap;
+};
+
+//Immutable token sequence shared by reference, such as a macro argument that is
+//read once for every use of its parameter
+struct tex_seq {
+	int ref;			//Number of owners, the last one frees the sequence
+	size_t n;
+	tex_packed tok[];
+};
+
+enum tex_macro_op_type {
+	TEX_OP_TOKENS,	//Span of body tokens
+	TEX_OP_PARAM	//Macro argument
+};
+
+struct tex_macro_op {
+	enum tex_macro_op_type type;
+	size_t i, n;	//TEX_OP_TOKENS: first token and number of tokens
+			//TEX_OP_PARAM: parameter number in n
+};
+
+//Replacement text of a macro, compiled when the macro is defined and read in place
+//by every expansion, with the parameter text its arguments are matched against
+struct tex_macro {
+	int ref;			//Number of values and input frames using this body
+	int param_n;			//Number of parameters the macro takes
+	struct tex_macro_op *op;
+	size_t op_n;
+	tex_packed *tok;		//Literal tokens
+	size_t tok_n;
+
+	//Parameter text, a TEX_PARAMETER token for each parameter followed by its delimiter
+	tex_packed *arg;
+	size_t arg_n;
+	size_t *fail;			//Delimiter matching table, see tex_macro_delimiters()
+};
+
 enum tex_val_type {
 	TEX_MACRO,	//A macro as defined by \def or equivalent construction
 	TEX_VAR		//A variable either set in TeX code or C code
@@ -61,13 +144,11 @@ enum tex_val_type {
 struct tex_val {
 	enum tex_val_type type;		//Type of value
 	struct tex_token cs;		//Control sequence that invokes this value (must be TEX_ESC)
-
-	//TEX_INVALID terminated token lists
-	struct tex_token *arglist;	//MACRO ONLY: format of expected argument list
-	struct tex_token *replacement;	//Tokens that should be evaluated in place of cs
+	struct tex_macro *macro;	//Tokens that should be evaluated in place of cs
 
 	//MACRO ONLY: handler function
 	struct tex_token *(*handler)(struct tex_parser *, struct tex_val);
+	int conditional;		//Handler starts a conditional, which a \fi ends
 };
 
 enum tex_char_stream_type {
@@ -89,72 +170,356 @@ struct tex_char_stream {
 		FILE *file;
 	};
 
-	char last;
+	uint32_t last;		//Last character read
+	int unread;		//TEX_FILE only: last is read again before the file
+	unsigned char ahead[4];	//TEX_FILE only: bytes read past the last character
+	int ahead_n;
+	int owned;		//TEX_FILE only: file is closed with the stream
+
+	void *map;		//TEX_BUF only: file mapping buf points into, or NULL
+	size_t map_n;
+	void (*release)(void *);	//TEX_BUF only: called with release_ctx when the stream
+	void *release_ctx;		//is freed, or NULL if the buffer is not owned
 
 	struct tex_char_stream *next;
 };
 
-struct tex_block {
-	char cat[128];  //Category code for ASCII characters
-			//Note: 0 (esc) is switched with 12 (other)
-			//internally for simplicity
-	struct tex_val vals[VAL_MAX];
-	size_t vals_n;
+enum tex_save_type {
+	TEX_SAVE_GROUP,		//Start of a group
+	TEX_SAVE_VAL,		//Previous value of a symbol
+	TEX_SAVE_CAT		//Previous category code of a character
+};
+
+//Save stack entry, undone when the group it was made in ends
+struct tex_save {
+	enum tex_save_type type;
+	union {
+		size_t base;	//TEX_SAVE_GROUP: start of the enclosing group
+		struct {
+			unsigned sym;
+			int level;
+			struct tex_val *val;
+		} val;		//TEX_SAVE_VAL
+		struct {
+			uint32_t c;
+			char cat;
+		} cat;		//TEX_SAVE_CAT
+	};
+};
+
+//Interned control sequence name
+struct tex_symbol {
+	char *name;
+	size_t len;
+	unsigned long hash;
+	unsigned next;		//Next symbol id in the same hash bucket
+
+	struct tex_val *val;	//Current value of this symbol, or NULL
+	int level;		//Group level val was defined at
+};
 
-	struct tex_block *parent;
+//Control sequence names by id, id 0 is unused
+struct tex_symtab {
+	struct tex_symbol *sym;
+	unsigned n, cap;
+	unsigned *bucket;	//Chain heads by hash, 0 for empty
+	size_t bucket_n;
 };
 
-struct tex_stack {
-	struct tex_token macro;
-	struct tex_token *parameter[9];
-	struct tex_stack *parent;
+#define TOKEN_SLAB_SIZE 1024
+
+struct tex_token_slab {
+	struct tex_token token[TOKEN_SLAB_SIZE];
+	struct tex_token_slab *next;
 };
 
-#define CHARBUF_SIZE 3
-#define MAP_SIZE 8
+//Slab allocator for token nodes, released nodes are kept on a free list
+struct tex_token_pool {
+	struct tex_token_slab *slab;	//Allocated slabs, newest first
+	size_t slab_n;			//Nodes handed out from the newest slab
+	struct tex_token *free;		//Released nodes, linked through next
+
+	size_t live;			//Nodes currently in use
+	size_t recycled;		//Allocations served from the free list
+	size_t allocated;		//Allocations in total
+};
+
+enum tex_frame_type {
+	TEX_FRAME_TOKENS,	//Token list, such as tokens put back in to the input
+	TEX_FRAME_SEQ,		//Shared token sequence, such as a macro argument
+	TEX_FRAME_MACRO		//Macro being expanded
+};
+
+//Input stack entry, tokens are read from the top frame before any character input
+struct tex_frame {
+	enum tex_frame_type type;
+
+	struct tex_token *token;		//TEX_FRAME_TOKENS: tokens left to read
+
+	struct tex_seq *seq;			//TEX_FRAME_SEQ: sequence being read from tok[i]
+
+	struct tex_macro *macro;		//TEX_FRAME_MACRO: body being read
+	size_t op, i;				//Position in macro->op and in that op
+	struct tex_seq *parameter[9];		//Arguments
+
+	struct tex_frame *parent;
+};
+
+#define TEX_CODEPOINT_MAX 0x10ffff
+#define TEX_RAW_BYTE 0x110000		//Code point of a byte that is not valid UTF-8 is this plus the byte
+
+#define TEX_CAT_PAGE_BITS 8
+#define TEX_CAT_PAGE_SIZE (1 << TEX_CAT_PAGE_BITS)
+#define TEX_CAT_PAGE_N ((TEX_CODEPOINT_MAX >> TEX_CAT_PAGE_BITS) + 1)
+
+//Category codes of TEX_CAT_PAGE_SIZE code points, shared between parsers until one
+//of them changes it
+struct tex_cat_page {
+	int ref;
+	char cat[TEX_CAT_PAGE_SIZE];
+};
+
+struct tex_map_edge {
+	unsigned char c;
+	unsigned node;
+};
+
+//Node of the glyph map trie, the path from the root spells an input sequence
+struct tex_map_node {
+	char *out;			//Replacement for the input ending here, or NULL
+	struct tex_map_edge *edge;	//Children sorted by character
+	size_t edge_n;
+};
+
+//Glyph map, node 0 is the root
+struct tex_map {
+	unsigned root[256];		//Children of the root by character, 0 for none
+	struct tex_map_node *node;
+	size_t node_n, node_cap;
+};
+
+#define TEX_SCAN_SPECIAL 1	//Byte must be read by tex_read_token()
+#define TEX_SCAN_SPACE 2	//Byte is a space character
+#define TEX_SCAN_MAP 4		//Byte may start a glyph mapping
+#define TEX_SCAN_CONT 8		//Byte continues a UTF-8 character
+
+//Byte classes used to find runs of plain characters in buffer streams
+struct tex_scan {
+	unsigned char cls[256];
+	unsigned char lut[16];	//Special ASCII bytes b, as bit (b >> 4) of lut[b & 15]
+	int dirty;		//Classes must be rebuilt before use
+	int high;		//Bytes above ASCII must be read by tex_read_token(), because
+				//they have category codes or may start a glyph mapping
+	size_t (*find)(struct tex_scan *, const char *, size_t);
+};
+
+#define TEX_OUT_CHUNK 65536	//Bytes of output handed to the writer thread at once
+#define TEX_OUT_QUEUE_MAX 16	//Chunks queued before \write waits for the writer
+
+//Output collected for a stream, written by the writer thread once full
+struct tex_out_chunk {
+	struct tex_out *out;
+	size_t n;
+	struct tex_out_chunk *next;
+	char d[TEX_OUT_CHUNK];
+};
+
+//Output stream opened by \openout
+struct tex_out {
+	FILE *file;
+	struct tex_out_chunk *chunk;	//Chunk being filled, or NULL
+	size_t pending;			//Chunks queued and not yet written
+	int error;			//errno of the first write that failed, or 0
+};
+
+//Thread writing the output streams of a parser behind it, fields below lock are
+//shared with the thread
+struct tex_writer {
+	pthread_t thread;
+	int started;			//Thread is running, if not chunks are written in place
+	pthread_mutex_t lock;
+	pthread_cond_t work;		//Chunks were queued, or stop was set
+	pthread_cond_t done;		//A chunk was written
+	struct tex_out_chunk *head, *tail;	//Chunks to write, oldest first
+	size_t queued;
+	struct tex_out_chunk *free;	//Written chunks, for reuse
+	int stop;
+};
+
+#define TEX_PREFETCH_MAX (64 << 20)	//Bytes of read ahead files held at once
+
+enum tex_prefetch_state {
+	TEX_PREFETCH_QUEUED,
+	TEX_PREFETCH_LOADING,
+	TEX_PREFETCH_READY,
+	TEX_PREFETCH_DONE,	//Taken, dropped or failed, kept so it is not queued again
+};
+
+//File read ahead of the \input or \include that names it
+struct tex_prefetch_file {
+	char *name;
+	enum tex_prefetch_state state;
+	int stale;		//Dropped while loading, the contents are thrown away
+	char *buf;
+	size_t n;
+	uint64_t dev, ino, mtime;	//Identity of the file that was read, so it can be
+				//checked that it is still the same when taken
+	uint64_t hash;		//Hash of the name
+	struct tex_prefetch_file *chain;	//Next file in the same bucket
+	struct tex_prefetch_file *next;
+};
+
+//Thread reading files ahead of the parser, fields below lock are shared with it
+struct tex_prefetch {
+	pthread_t thread;
+	int started;			//Thread is running, nothing is read ahead if not
+	pthread_mutex_t lock;
+	pthread_cond_t work;		//A file was queued, or stop was set
+	pthread_cond_t done;		//A file finished loading
+	struct tex_prefetch_file *head, *tail;	//Every file named so far, oldest first
+	struct tex_prefetch_file *load;	//First file the thread has not yet looked at
+	struct tex_prefetch_file **bucket;	//Files by hash of their name
+	size_t bucket_n, file_n;
+	size_t held;			//Bytes of loaded files not yet taken
+	int stop;
+};
+
+//File a document read or wrote
+struct tex_dep {
+	char *name;
+	int output;		//Written by the document rather than read
+};
+
+//Profile of one control sequence
+struct tex_profile_cs {
+	size_t calls;
+	uint64_t incl, excl;		//Nanoseconds with and without nested expansions
+	size_t tokens;			//Tokens produced by its expansions
+	size_t args;			//Tokens in its arguments
+	size_t depth;			//Deepest input stack at a call
+	int active;			//Expansions not yet ended
+	uint64_t since;			//Start of the first of the active expansions
+};
+
+//Expansion being timed
+struct tex_profile_open {
+	unsigned sym;
+	size_t id;
+	struct tex_frame *frame;	//Macro frame whose end ends the expansion, or NULL
+	uint64_t start;
+	uint64_t child;			//Time spent in nested expansions
+};
+
+struct tex_profile {
+	struct tex_profile_cs *cs;	//By symbol id
+	size_t cs_n;
+	struct tex_profile_open *open;	//Expansions being timed, innermost last
+	size_t open_n, open_cap;
+	size_t next_id;
+};
+
+//C handler registered under a control sequence name, so formats can refer to it
+struct tex_handler {
+	unsigned sym;
+	struct tex_token *(*fn)(struct tex_parser *, struct tex_val);
+	int conditional;
+};
 
 struct tex_parser {
 	struct tex_char_stream *char_stream;	//Stream of input characters
-	struct tex_token *token;		//Stream of saved tokens (read before character input)
-	struct tex_block *block;		//Hierarchy of namespaces
-	struct tex_stack *stack;		//Hierarchy of macro replacements
+	struct tex_frame *input;		//Stack of token input (read before character input)
+	struct tex_frame *frame_free;		//Unused frames
+	size_t input_n;				//Frames on the input stack
+	char cat[128];				//Category code for ASCII characters
+						//Note: 0 (esc) is switched with 12 (other)
+						//internally for simplicity
+	struct tex_cat_page **cat_page;		//Category codes above ASCII by page, or NULL
+						//while they are all TEX_OTHER
+	int level;				//Group nesting depth, 0 outside any group
+	struct tex_save *save;			//Values to restore at group exit
+	size_t save_n, save_cap;
+	size_t save_base;			//Start of the current group on the save stack
+	struct tex_token_pool pool;		//Storage for token nodes
+	struct tex_symtab symtab;		//Interned control sequence names
 	enum tex_state state;			//Current state of tokenizer
 
 	//Error handler in printf style, should not return
 	void (*error)(struct tex_parser *, char *fmt, ...);
-
-	FILE *include;
-	FILE *in[16], *out[16];			//Input/output streams
-
-	//Buffer used by tex_read_glyph()
-	char charbuf[CHARBUF_SIZE];
-	size_t charbuf_n;
+	jmp_buf *recover;			//Where the default error handler jumps to instead
+						//of exiting, the parser may only be freed afterwards
+	void *error_ctx;			//For the use of the error handler
+
+	FILE *include;				//File written verbatim to the output
+	char *include_buf;			//Read ahead contents include reads from, or NULL
+	size_t include_at;			//Lookahead characters written before include
+	FILE *in[16];				//Input streams
+	struct tex_out *out[16];		//Output streams
+	struct tex_writer *writer;		//Writes the output streams, or NULL before
+						//any is opened
+	struct tex_prefetch *prefetch;		//Reads input files ahead, or NULL before any
+						//is named
+
+	//Lookahead buffer used by tex_read_glyph()
+	char *charbuf;
+	size_t charbuf_n, charbuf_cap;
 	char *mapout;
 
 	//Character sequence map
-	struct {char *in, *out;} map[MAP_SIZE];
+	struct tex_map map;
+	struct tex_scan scan;
 
 	int in_global;
+	struct tex_tokvec argbuf;		//Macro arguments being read
+	size_t cond_n;				//Conditionals not yet ended by \fi
+
+	//Counters for --profile
+	size_t char_n;				//Characters read from the input
+	size_t token_n;				//Tokens read from characters
+	size_t input_token_n;			//Tokens read from the token input
+	size_t group_n;				//Groups entered
+	struct tex_profile *profile;		//Per control sequence profile, or NULL
+
+	struct tex_dep *dep;			//Files read and written so far
+	size_t dep_n;
+
+	struct tex_handler *handler;		//Handlers by registered name
+	size_t handler_n;
+	void *format;				//Loaded format file, macro bodies point in to it,
+	size_t format_n;			//NULL for clones, which use their template's
+
+	//Symbols used by the parser itself
+	unsigned sym_par, sym_else, sym_fi, sym_iftrue, sym_iffalse;
 };
 
 //Parser related functions
 void tex_init_parser(struct tex_parser *p);
+void tex_clone_parser(struct tex_parser *p, struct tex_parser *template);
 void tex_parse(struct tex_parser *p, char *buf, size_t n);
 void tex_free_parser(struct tex_parser *p);
 
 void tex_input(struct tex_parser *p, char *filename);
+void tex_dep_add(struct tex_parser *p, char *name, int output);
 void tex_input_file(struct tex_parser *p, char *name, FILE *file);
+void tex_input_buf(struct tex_parser *p, char *name, char *buf, size_t n);
+void tex_input_borrow(struct tex_parser *p, char *name, char *buf, size_t n, void (*release)(void *), void *ctx);
 void tex_input_str(struct tex_parser *p, char *name, char *input);
 void tex_input_token(struct tex_parser *p, struct tex_token t);
+void tex_input_list(struct tex_parser *p, struct tex_token *ts);
+void tex_input_macro(struct tex_parser *p, struct tex_macro *m, struct tex_seq **parameter);
 void tex_input_tokens(struct tex_parser *p, struct tex_token *ts, size_t n);
 
 
 void tex_block_enter(struct tex_parser *p);
 void tex_block_exit(struct tex_parser *p);
 
-void tex_define_macro_tokens(struct tex_parser *p, char *cs, struct tex_token *arglist, struct tex_token *replacement);
+void tex_define_macro_tokens(struct tex_parser *p, unsigned cs, struct tex_token *arglist, struct tex_token *replacement);
+struct tex_macro *tex_macro_compile(struct tex_parser *p, struct tex_token *arglist, struct tex_token *replacement);
+void tex_macro_delimiters(struct tex_macro *m);
+void tex_macro_release(struct tex_macro *m);
 void tex_define_macro_func(struct tex_parser *p, char *cs, struct tex_token * (*handler)(struct tex_parser*, struct tex_val));
+void tex_define_conditional(struct tex_parser *p, char *cs, struct tex_token * (*handler)(struct tex_parser*, struct tex_val));
 
+struct tex_token *tex_handle_macro_general(struct tex_parser* p, struct tex_val m);
 struct tex_token *tex_handle_macro_par(struct tex_parser* p, struct tex_val m);
 struct tex_token *tex_handle_macro_def(struct tex_parser* p, struct tex_val m);
 struct tex_token *tex_handle_macro_edef(struct tex_parser* p, struct tex_val m);
@@ -169,40 +534,145 @@ struct tex_token *tex_handle_macro_amp(struct tex_parser* p, struct tex_val m);
 struct tex_token *tex_handle_macro_space(struct tex_parser* p, struct tex_val m);
 struct tex_token *tex_handle_macro_iffalse(struct tex_parser* p, struct tex_val m);
 struct tex_token *tex_handle_macro_iftrue(struct tex_parser* p, struct tex_val m);
+struct tex_token *tex_handle_macro_else(struct tex_parser* p, struct tex_val m);
+struct tex_token *tex_handle_macro_fi(struct tex_parser* p, struct tex_val m);
 
 struct tex_token tex_read_token(struct tex_parser *p);
 struct tex_token tex_read_char(struct tex_parser *p);
 void tex_unread_char(struct tex_parser *p);
-char *tex_read_control_sequence(struct tex_parser *p);
+unsigned tex_read_control_sequence(struct tex_parser *p);
 int tex_read_num(struct tex_parser *p);
 char *tex_read_filename(struct tex_parser *p);
-void tex_parse_arguments(struct tex_parser *p, struct tex_token *arglist);
+void tex_parse_arguments(struct tex_parser *p, struct tex_macro *m, struct tex_seq **parameter);
 struct tex_token *tex_parse_arglist(struct tex_parser *p);
 struct tex_token *tex_read_block(struct tex_parser *p);
 struct tex_token *tex_read_and_expand_block(struct tex_parser *p);
 char tex_read_glyph(struct tex_parser *p);
+void tex_include(struct tex_parser *p, FILE *f);
+void tex_include_buf(struct tex_parser *p, char *buf, size_t n);
 int tex_read(struct tex_parser *p, char *buf, int n);
 struct tex_token *tex_expand_token(struct tex_parser *p, struct tex_token t);
 
 struct tex_val *tex_val_find(struct tex_parser *p, struct tex_token t);
 void tex_val_set(struct tex_parser *p, struct tex_val v);
+void tex_val_set_global(struct tex_parser *p, struct tex_val v);
+void tex_catcode_set(struct tex_parser *p, uint32_t c, enum tex_category cat);
+
+//Symbol related functions
+void tex_symtab_init(struct tex_parser *p);
+void tex_symtab_free(struct tex_parser *p);
+void tex_symtab_copy(struct tex_parser *p, struct tex_parser *from);
+unsigned tex_symbol(struct tex_parser *p, char *name);
+unsigned tex_symbol_n(struct tex_parser *p, char *name, size_t n);
+unsigned tex_symbol_find(struct tex_parser *p, char *name, size_t n);
+char *tex_symbol_name(struct tex_parser *p, unsigned id);
+
+//Glyph map related functions
+void tex_map_init(struct tex_parser *p);
+void tex_map_free(struct tex_parser *p);
+void tex_map_copy(struct tex_parser *p, struct tex_parser *from);
+void tex_map_add(struct tex_parser *p, char *in, char *out);
+unsigned tex_map_next(struct tex_map *map, unsigned node, unsigned char c);
+
+//File in a dependency database record
+struct tex_depdb_file {
+	char *name;
+	int output;
+	uint64_t hash;		//Hash of the contents when the record was made
+};
+
+//Files an output was made from, and other files written with it
+struct tex_depdb_doc {
+	char *out;
+	char *in;		//Input the manifest named for the output
+	char *format;		//Format the output was rendered with, or NULL
+	struct tex_depdb_file *file;
+	size_t file_n;
+};
+
+struct tex_depdb {
+	struct tex_depdb_doc *doc;
+	size_t doc_n;
+};
+
+//Dependency database related functions
+int tex_hash_file(char *name, uint64_t *hash);
+int tex_depdb_load(struct tex_depdb *db, char *filename);
+int tex_depdb_save(struct tex_depdb *db, char *filename);
+void tex_depdb_free(struct tex_depdb *db);
+struct tex_depdb_doc *tex_depdb_find(struct tex_depdb *db, char *out);
+int tex_depdb_set(struct tex_depdb *db, struct tex_depdb_doc doc);
+void tex_depdb_remove(struct tex_depdb *db, char *out);
+int tex_depdb_record(struct tex_depdb_doc *doc, char *in, char *out, char *format, struct tex_dep *dep, size_t dep_n);
+int tex_depdb_fresh(struct tex_depdb_doc *doc, char *in, char *format);
+
+//Profiler related functions
+void tex_profile_start(struct tex_parser *p);
+void tex_profile_free(struct tex_parser *p);
+struct tex_token *tex_profile_call(struct tex_parser *p, struct tex_val *m);
+void tex_profile_frame(struct tex_parser *p, struct tex_frame *f);
+void tex_profile_print(struct tex_parser *p, FILE *f);
+void tex_profile_json(struct tex_parser *p, FILE *f);
+
+//Format file related functions
+void tex_format_dump(struct tex_parser *p, char *filename);
+void tex_format_load(struct tex_parser *p, char *filename);
+
+//Output stream related functions
+int tex_out_open(struct tex_parser *p, int n, char *filename);
+void tex_out_write(struct tex_parser *p, int n, const char *s, size_t len);
+void tex_out_tokens(struct tex_parser *p, int n, struct tex_token *t);
+void tex_out_close(struct tex_parser *p, int n);
+void tex_out_close_all(struct tex_parser *p);
+void tex_out_free(struct tex_parser *p);
+
+//Read ahead related functions
+void tex_prefetch(struct tex_parser *p, const char *name);
+void tex_prefetch_list(struct tex_parser *p, char *filename);
+void tex_prefetch_scan(struct tex_parser *p, const char *buf, size_t n);
+int tex_prefetch_take(struct tex_parser *p, const char *name, char **buf, size_t *n);
+void tex_prefetch_drop(struct tex_parser *p, const char *name);
+void tex_prefetch_free(struct tex_parser *p);
+
+//Scanner related functions
+void tex_scan_init(struct tex_scan *scan);
+void tex_scan_update(struct tex_parser *p);
+size_t tex_scan(struct tex_parser *p, const char *s, size_t n);
+
+//Unicode related functions
+size_t tex_utf8_len(unsigned char b);
+size_t tex_utf8_decode(const char *s, size_t n, uint32_t *c);
+enum tex_category tex_catcode(struct tex_parser *p, uint32_t c);
+enum tex_category tex_catcode_wide(struct tex_parser *p, uint32_t c);
+void tex_catcode_store(struct tex_parser *p, uint32_t c, enum tex_category cat);
+void tex_cat_pages_copy(struct tex_parser *p, struct tex_parser *from);
+void tex_cat_pages_free(struct tex_parser *p);
 
 //Char stream related functions
 struct tex_char_stream *tex_char_stream_str(char *input, struct tex_char_stream *next);
 
 //Token related functions
-struct tex_token *tex_token_alloc(struct tex_token t);
-struct tex_token *tex_token_copy(struct tex_token *t);
-void tex_token_free(struct tex_token *t);
+struct tex_token *tex_token_alloc(struct tex_parser *p, struct tex_token t);
+struct tex_token *tex_token_copy(struct tex_parser *p, struct tex_token *t);
+void tex_token_free(struct tex_parser *p, struct tex_token *t);
+void tex_token_release(struct tex_parser *p, struct tex_token *t);
+void tex_token_pool_free(struct tex_parser *p);
 struct tex_token *tex_token_join(struct tex_token *before, struct tex_token *after);
-struct tex_token *tex_token_append(struct tex_token *before, struct tex_token t);
-struct tex_token *tex_token_prepend(struct tex_token t, struct tex_token *after);
+struct tex_token *tex_token_append(struct tex_parser *p, struct tex_token *before, struct tex_token t);
+struct tex_token *tex_token_prepend(struct tex_parser *p, struct tex_token t, struct tex_token *after);
+void tex_token_list_append(struct tex_parser *p, struct tex_token_list *l, struct tex_token t);
+void tex_token_list_extend(struct tex_parser *p, struct tex_token_list *l, struct tex_token *ts);
+void tex_token_list_join(struct tex_token_list *l, struct tex_token_list after);
+void tex_tokvec_push(struct tex_parser *p, struct tex_tokvec *v, tex_packed t);
+struct tex_seq *tex_seq_from_array(struct tex_parser *p, tex_packed *tok, size_t n);
+void tex_seq_release(struct tex_seq *s);
 int tex_token_eq(struct tex_token a, struct tex_token b);
-void tex_token_print(struct tex_token t);
-void tex_tokenlist_print(struct tex_token *t);
-char *tex_tokenlist_as_str(struct tex_token *t);
-struct tex_token *tex_str_as_tokenlist(char *s);
-size_t tex_tokenlist_len(struct tex_token *t);
+void tex_token_print(struct tex_parser *p, struct tex_token t);
+void tex_tokenlist_print(struct tex_parser *p, struct tex_token *t);
+size_t tex_token_str(struct tex_parser *p, struct tex_token *t, char *s);
+char *tex_tokenlist_as_str(struct tex_parser *p, struct tex_token *t);
+struct tex_token *tex_str_as_tokenlist(struct tex_parser *p, char *s);
+size_t tex_tokenlist_len(struct tex_parser *p, struct tex_token *t);
 
 struct tex_token *tex_macro_replace(struct tex_parser *p, struct tex_token t);
 struct tex_token *tex_parameter_replace(struct tex_parser *p, struct tex_token t);
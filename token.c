@@ -1,16 +1,42 @@
 #include <assert.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "tex.h"
 
-struct tex_token *tex_token_alloc(struct tex_token t) {
-	struct tex_token *ret = malloc(sizeof(*ret));
-	assert(ret != NULL);
+//Take one node from the parser's token pool, preferring recycled nodes
+static struct tex_token *tex_token_node(struct tex_parser *p) {
+	struct tex_token_pool *pool = &p->pool;
+	struct tex_token *ret;
+
+	if(pool->free) {
+		ret = pool->free;
+		pool->free = ret->next;
+		pool->recycled++;
+	} else {
+		if(!pool->slab || pool->slab_n == TOKEN_SLAB_SIZE) {
+			struct tex_token_slab *slab = malloc(sizeof *slab);
+			if(!slab) p->error(p, "Could not allocate memory");
+			slab->next = pool->slab;
+			pool->slab = slab;
+			pool->slab_n = 0;
+		}
+		ret = &pool->slab->token[pool->slab_n++];
+	}
+
+	pool->live++;
+	pool->allocated++;
+	return ret;
+}
+
+struct tex_token *tex_token_alloc(struct tex_parser *p, struct tex_token t) {
+	struct tex_token *ret = tex_token_node(p);
 
 	ret->cat = t.cat;
 	if(t.cat == TEX_ESC)
-		ret->s = strdup(t.s);
+		ret->sym = t.sym;
 	else
 		ret->c = t.c;
 
@@ -20,24 +46,70 @@ struct tex_token *tex_token_alloc(struct tex_token t) {
 	return ret;
 }
 
-struct tex_token *tex_token_copy(struct tex_token *t) {
-	struct tex_token *ret = NULL;
-	while(t) {
-		ret = tex_token_append(ret, *t);
-		t = t->next;
+struct tex_token *tex_token_copy(struct tex_parser *p, struct tex_token *t) {
+	struct tex_token_list ret = {0};
+	tex_token_list_extend(p, &ret, t);
+	return ret.head;
+}
+
+//Append a token to a vector, growing it as needed
+void tex_tokvec_push(struct tex_parser *p, struct tex_tokvec *v, tex_packed t) {
+	if(v->n == v->cap) {
+		size_t cap = v->cap ? 2*v->cap : 64;
+		tex_packed *tok = realloc(v->tok, cap * sizeof *tok);
+		if(!tok) p->error(p, "Could not allocate memory");
+		v->tok = tok;
+		v->cap = cap;
 	}
-	return ret;
+	v->tok[v->n++] = t;
+}
+
+//Copy n tokens in to a shared sequence with one reference, no tokens give NULL
+struct tex_seq *tex_seq_from_array(struct tex_parser *p, tex_packed *tok, size_t n) {
+	if(n == 0) return NULL;
+
+	struct tex_seq *s = malloc(sizeof *s + n * sizeof *s->tok);
+	if(!s) p->error(p, "Could not allocate memory");
+	s->ref = 1;
+	s->n = n;
+	memcpy(s->tok, tok, n * sizeof *tok);
+	return s;
+}
+
+//Drop one reference to a sequence
+void tex_seq_release(struct tex_seq *s) {
+	if(s && --s->ref == 0)
+		free(s);
 }
 
-void tex_token_free(struct tex_token *t) {
+//Return a single token node to the pool
+void tex_token_release(struct tex_parser *p, struct tex_token *t) {
 	if(t == NULL) return;
 
-	if(t->cat == TEX_ESC)
-		free(t->s);
+	t->next = p->pool.free;
+	p->pool.free = t;
+	p->pool.live--;
+}
+
+//Free a token list
+void tex_token_free(struct tex_parser *p, struct tex_token *t) {
+	while(t) {
+		struct tex_token *next = t->next;
+		tex_token_release(p, t);
+		t = next;
+	}
+}
+
+//Release all token storage, any outstanding token pointers become invalid
+void tex_token_pool_free(struct tex_parser *p) {
+	struct tex_token_slab *slab = p->pool.slab;
+	while(slab) {
+		struct tex_token_slab *next = slab->next;
+		free(slab);
+		slab = next;
+	}
 
-	//TODO: this is a bad idea
-	tex_token_free(t->next);
-	free(t);
+	p->pool = (struct tex_token_pool){0};
 }
 
 struct tex_token *tex_token_join(struct tex_token *before, struct tex_token *after) {
@@ -55,27 +127,63 @@ struct tex_token *tex_token_join(struct tex_token *before, struct tex_token *aft
 	return ret;
 }
 
-struct tex_token *tex_token_append(struct tex_token *before, struct tex_token t) {
-	return tex_token_join(before, tex_token_alloc(t));
+struct tex_token *tex_token_append(struct tex_parser *p, struct tex_token *before, struct tex_token t) {
+	return tex_token_join(before, tex_token_alloc(p, t));
+}
+
+struct tex_token *tex_token_prepend(struct tex_parser *p, struct tex_token t, struct tex_token *after) {
+	return tex_token_join(tex_token_alloc(p, t), after);
+}
+
+void tex_token_list_append(struct tex_parser *p, struct tex_token_list *l, struct tex_token t) {
+	struct tex_token *n = tex_token_alloc(p, t);
+
+	if(l->tail) {
+		l->tail->next = n;
+		n->prev = l->tail;
+	} else
+		l->head = n;
+
+	l->tail = n;
 }
 
-struct tex_token *tex_token_prepend(struct tex_token t, struct tex_token *after) {
-	return tex_token_join(tex_token_alloc(t), after);
+//Append a copy of every token in ts
+void tex_token_list_extend(struct tex_parser *p, struct tex_token_list *l, struct tex_token *ts) {
+	while(ts) {
+		tex_token_list_append(p, l, *ts);
+		ts = ts->next;
+	}
+}
+
+//Move the tokens of after to the end of l
+void tex_token_list_join(struct tex_token_list *l, struct tex_token_list after) {
+	if(!after.head) return;
+
+	if(l->tail) {
+		l->tail->next = after.head;
+		after.head->prev = l->tail;
+	} else
+		l->head = after.head;
+
+	l->tail = after.tail;
 }
 
-void tex_token_print(struct tex_token t) {
+void tex_token_print(struct tex_parser *p, struct tex_token t) {
 	switch(t.cat) {
-	case TEX_ESC: printf("\\%s ",t.s); break;
-	case TEX_PARAMETER: printf("#%i ", t.c); break;
+	case TEX_ESC: printf("\\%s ", tex_symbol_name(p, t.sym)); break;
+	case TEX_PARAMETER: printf("#%i ", (int)t.c); break;
 	default:
 		if(t.c == 0) printf("NULL_%i ", t.cat);
-		else printf("%c_%i ", t.c, t.cat);
+		else {
+			char buf[4];
+			printf("%.*s_%i ", (int)tex_utf8_encode(t.c, buf), buf, t.cat);
+		}
 	}
 }
 
-void tex_tokenlist_print(struct tex_token *t) {
+void tex_tokenlist_print(struct tex_parser *p, struct tex_token *t) {
 	while(t) {
-		tex_token_print(*t);
+		tex_token_print(p, *t);
 		t = t->next;
 	}
 }
@@ -83,56 +191,106 @@ void tex_tokenlist_print(struct tex_token *t) {
 int tex_token_eq(struct tex_token a, struct tex_token b) {
 	if(a.cat != b.cat) return 0;
 	if(a.cat == TEX_ESC) {
-		return strcmp(a.s, b.s) == 0;
+		return a.sym == b.sym;
 	}
 	return a.c == b.c;
 }
 
-size_t tex_tokenlist_len(struct tex_token *t) {
+//Write the text of t to s, which must have room for a backslash and the name of a
+//control sequence, or 4 bytes for any other token. Returns the number of bytes written
+size_t tex_token_str(struct tex_parser *p, struct tex_token *t, char *s) {
+	switch(t->cat){
+	case TEX_ESC: {
+		struct tex_symbol *sym = &p->symtab.sym[t->sym];
+		s[0] = '\\';
+		memcpy(s + 1, sym->name, sym->len);
+		return 1 + sym->len;
+		}
+	case TEX_PARAMETER:
+		s[0] = '#';
+		s[1] = '0' + t->c;
+		return 2;
+	default:
+		return tex_utf8_encode(t->c, s);
+	}
+}
+
+size_t tex_tokenlist_len(struct tex_parser *p, struct tex_token *t) {
 	size_t n = 0;
 	while(t) {
 		switch(t->cat){
-		case TEX_ESC: n += strlen(t->s); break;
+		case TEX_ESC: n += 1 + p->symtab.sym[t->sym].len; break;
 		case TEX_PARAMETER: n += 2; break;
-		default: n++;
+		default: {
+			char buf[4];
+			n += tex_utf8_encode(t->c, buf);
+			}
 		}
 		t = t->next;
 	}
 	return n;
 }
 
-char *tex_tokenlist_as_str(struct tex_token *t) {
-	size_t len = tex_tokenlist_len(t);
+char *tex_tokenlist_as_str(struct tex_parser *p, struct tex_token *t) {
+	size_t len = tex_tokenlist_len(p, t);
 	char *s, *ret = malloc(len+1);
 	assert(ret);
 
 	s = ret;
-	while(t) {
-		switch(t->cat){
-		case TEX_ESC: *(s++) = '\\'; strcpy(s, t->s); s += strlen(t->s); break;
-		case TEX_PARAMETER: *(s++) = '#'; *(s++) = '0'+t->c; break;
-		default: *(s++) = t->c;
-		}
-		t = t->next;
-	}
+	for(; t; t = t->next)
+		s += tex_token_str(p, t, s);
 	*s = 0;
 	return ret;
 }
 
+//Error of the parser tokenizing a string, raised again on the parser that asked for it
+struct tex_str_error {
+	char msg[BUFSIZE];
+	jmp_buf recover;
+};
+
+static void tex_str_error(struct tex_parser *p, char *fmt, ...) {
+	struct tex_str_error *e = p->error_ctx;
+
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(e->msg, sizeof e->msg, fmt, ap);
+	va_end(ap);
+
+	longjmp(e->recover, 1);
+}
+
 //Returns a token list where all the characters of s are tokenized as TEX_OTHER
-struct tex_token *tex_str_as_tokenlist(char *s) {
+//The tokens are allocated from p
+struct tex_token *tex_str_as_tokenlist(struct tex_parser *p, char *s) {
 	if(!s) return NULL;
 
-	struct tex_parser p;
-	tex_init_parser(&p);
-	tex_input_str(&p, "<str>", s);
+	struct tex_parser str;
+	struct tex_str_error e;
+	struct tex_token_list out = {0};
+
+	tex_init_parser(&str);
+	str.error = tex_str_error;
+	str.error_ctx = &e;
+
+	//The string's parser is freed before its error is raised on p
+	if(setjmp(e.recover)) {
+		tex_free_parser(&str);
+		tex_token_free(p, out.head);
+		p->error(p, "%s", e.msg);
+	}
+
+	tex_input_borrow(&str, "<str>", s, strlen(s), NULL, NULL);
 
-	struct tex_token *out = NULL;
 	for(;;){
-		struct tex_token t = tex_read_token(&p);
+		struct tex_token t = tex_read_token(&str);
 		if(t.cat == TEX_INVALID) break;
-		out  = tex_token_append(out, t);
+		if(t.cat == TEX_ESC)
+			t.sym = tex_symbol(p, tex_symbol_name(&str, t.sym));
+		tex_token_list_append(p, &out, t);
 	}
 
-	return out;
+	tex_free_parser(&str);
+
+	return out.head;
 }
@@ -0,0 +1,169 @@
+/* unicode.c
+ *
+ * UTF-8 decoding for the character reader and encoding for output, and the
+ * category codes of code points above ASCII.
+ *
+ * Those category codes are kept in a two level table: an array of pages of
+ * 256 code points each, where a page is only allocated once one of its code
+ * points is given a category other than TEX_OTHER. Pages are reference counted
+ * and copied on write, so clones of a parser share them until one changes.
+ * ASCII category codes stay in the flat array in the parser, which is all the
+ * reader looks at for ASCII input.
+ *
+ * Bytes that are not valid UTF-8 are read as the code point TEX_RAW_BYTE plus
+ * the byte and written out as that byte again, so malformed input passes
+ * through unchanged.
+ *
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tex.h"
+
+//Number of bytes in the character starting with b, 1 for bytes that can not start one
+size_t tex_utf8_len(unsigned char b) {
+	if(b >= 0xc2 && b <= 0xdf) return 2;
+	if(b >= 0xe0 && b <= 0xef) return 3;
+	if(b >= 0xf0 && b <= 0xf4) return 4;
+	return 1;
+}
+
+//Decode the character at the start of the n > 0 bytes at s, returns the number of
+//bytes it takes. An invalid sequence decodes its first byte as a raw byte
+size_t tex_utf8_decode(const char *s, size_t n, uint32_t *c) {
+	const unsigned char *u = (const unsigned char *)s;
+	size_t len = tex_utf8_len(u[0]);
+
+	if(u[0] < 0x80) {
+		*c = u[0];
+		return 1;
+	}
+
+	*c = TEX_RAW_BYTE + u[0];
+	if(len == 1 || n < len)
+		return 1;
+
+	static const unsigned char lead_mask[5] = {0, 0, 0x1f, 0x0f, 0x07};
+	static const uint32_t min[5] = {0, 0, 0x80, 0x800, 0x10000};
+
+	uint32_t v = u[0] & lead_mask[len];
+	for(size_t i = 1; i < len; i++) {
+		if((u[i] & 0xc0) != 0x80)
+			return 1;
+		v = v << 6 | (u[i] & 0x3f);
+	}
+
+	//Overlong forms, surrogates and code points past Unicode are not characters
+	if(v < min[len] || v > TEX_CODEPOINT_MAX || (v >= 0xd800 && v <= 0xdfff))
+		return 1;
+
+	*c = v;
+	return len;
+}
+
+//Write a character above ASCII as UTF-8, see tex_utf8_encode()
+size_t tex_utf8_encode_wide(uint32_t c, char *out) {
+	if(c >= TEX_RAW_BYTE) {
+		out[0] = c - TEX_RAW_BYTE;
+		return 1;
+	}
+	if(c < 0x800) {
+		out[0] = 0xc0 | c >> 6;
+		out[1] = 0x80 | (c & 0x3f);
+		return 2;
+	}
+	if(c < 0x10000) {
+		out[0] = 0xe0 | c >> 12;
+		out[1] = 0x80 | (c >> 6 & 0x3f);
+		out[2] = 0x80 | (c & 0x3f);
+		return 3;
+	}
+	out[0] = 0xf0 | c >> 18;
+	out[1] = 0x80 | (c >> 12 & 0x3f);
+	out[2] = 0x80 | (c >> 6 & 0x3f);
+	out[3] = 0x80 | (c & 0x3f);
+	return 4;
+}
+
+//Category code of a code point above ASCII
+enum tex_category tex_catcode_wide(struct tex_parser *p, uint32_t c) {
+	if(!p->cat_page || c > TEX_CODEPOINT_MAX)
+		return TEX_OTHER;
+
+	struct tex_cat_page *page = p->cat_page[c >> TEX_CAT_PAGE_BITS];
+	return page ? page->cat[c & (TEX_CAT_PAGE_SIZE - 1)] : TEX_OTHER;
+}
+
+//Category code of any code point
+enum tex_category tex_catcode(struct tex_parser *p, uint32_t c) {
+	return c < 128 ? p->cat[c] : tex_catcode_wide(p, c);
+}
+
+static void tex_cat_page_release(struct tex_cat_page *page) {
+	if(page && --page->ref == 0)
+		free(page);
+}
+
+//Set the category code of c without saving the old one
+void tex_catcode_store(struct tex_parser *p, uint32_t c, enum tex_category cat) {
+	assert(c <= TEX_CODEPOINT_MAX);
+
+	if(c < 128) {
+		p->cat[c] = cat;
+		p->scan.dirty = TRUE;
+		return;
+	}
+
+	if(!p->cat_page) {
+		if(cat == TEX_OTHER) return;
+		p->cat_page = calloc(TEX_CAT_PAGE_N, sizeof *p->cat_page);
+		if(!p->cat_page) p->error(p, "Could not allocate memory");
+		p->scan.dirty = TRUE;
+	}
+
+	struct tex_cat_page **slot = &p->cat_page[c >> TEX_CAT_PAGE_BITS];
+	struct tex_cat_page *page = *slot;
+	if(page && page->cat[c & (TEX_CAT_PAGE_SIZE - 1)] == cat)
+		return;
+	if(!page && cat == TEX_OTHER)
+		return;
+
+	//Pages shared with another parser are copied before they change, new pages are
+	//all TEX_OTHER, which is 0
+	if(!page || page->ref > 1) {
+		struct tex_cat_page *copy = page ? malloc(sizeof *copy) : calloc(1, sizeof *copy);
+		if(!copy) p->error(p, "Could not allocate memory");
+		if(page)
+			*copy = *page;
+		copy->ref = 1;
+
+		tex_cat_page_release(page);
+		*slot = page = copy;
+	}
+
+	page->cat[c & (TEX_CAT_PAGE_SIZE - 1)] = cat;
+}
+
+//Share the category code pages of another parser
+void tex_cat_pages_copy(struct tex_parser *p, struct tex_parser *from) {
+	if(!from->cat_page) return;
+
+	p->cat_page = malloc(TEX_CAT_PAGE_N * sizeof *p->cat_page);
+	if(!p->cat_page) p->error(p, "Could not allocate memory");
+
+	for(size_t i = 0; i < TEX_CAT_PAGE_N; i++) {
+		p->cat_page[i] = from->cat_page[i];
+		if(p->cat_page[i]) p->cat_page[i]->ref++;
+	}
+}
+
+void tex_cat_pages_free(struct tex_parser *p) {
+	if(!p->cat_page) return;
+
+	for(size_t i = 0; i < TEX_CAT_PAGE_N; i++)
+		tex_cat_page_release(p->cat_page[i]);
+	free(p->cat_page);
+	p->cat_page = NULL;
+}